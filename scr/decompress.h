@@ -0,0 +1,537 @@
+// Notes:
+// GZIP RFC:   https://datatracker.ietf.org/doc/html/rfc1952
+// BGZF:       SAM/BAM format specification, section 4.1 "The BGZF compression format"
+// Zstandard:  https://datatracker.ietf.org/doc/html/rfc8878, decompressed when built with DECOMPRESS_WITH_ZSTD and -lzstd
+
+#include "stdlib.h"
+#include "string.h"
+#include "internal_utils.h"
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#if __linux__
+#include <pthread.h>
+#include <sys/mman.h>
+#endif // __linux__
+#ifdef DECOMPRESS_WITH_ZSTD
+#include <zstd.h>
+#endif // DECOMPRESS_WITH_ZSTD
+
+#ifndef DECOMPRESS_HEADER
+#define DECOMPRESS_HEADER
+
+#define DECOMPRESS_NONE 0
+#define DECOMPRESS_GZIP 1
+#define DECOMPRESS_BGZF 2 // Gzip members with own compressed size in extra field, as written by bgzip
+#define DECOMPRESS_ZSTD 3
+
+#define DECOMPRESS_ERROR_READ -1
+#define DECOMPRESS_ERROR_DATA -2 // Corrupted or truncated input
+#define DECOMPRESS_ERROR_UNSUPPORTED -3 // Zstandard input without DECOMPRESS_WITH_ZSTD, nothing is read
+
+// Enough to see BGZF extra subfield
+#define DECOMPRESS_MAGIC_SIZE 18
+#define DECOMPRESS_IN_SIZE (1 << 17)
+#define DECOMPRESS_OUT_SIZE (1 << 18)
+// Frames decompressed ahead of the sink, per worker
+#define DECOMPRESS_SLOTS_PER_WORKER 4
+// Frames with bigger or unknown content size are streamed instead of decompressed in parallel
+#define DECOMPRESS_FRAME_LIMIT (1 << 26)
+
+// Receives decompressed data in input order
+typedef void (*DecompressSink)(void *context, const unsigned char *buff, size_t size);
+
+// Source of streamed input, prefix is returned before anything is read from fd
+struct
+{
+    int fd; // -1 when prefix is the whole input
+    const unsigned char *prefix;
+    size_t prefix_size;
+    unsigned char *buff;
+} typedef DecompressInput, *pDecompressInput;
+
+// Independently decompressible part of mapped input
+struct
+{
+    size_t offset;
+    size_t size;
+    size_t output_size;
+} typedef DecompressFrame, *pDecompressFrame;
+
+// Output of one frame, reused for frame index + slots count once consumed
+struct
+{
+    size_t ready; // Index of decompressed frame plus one
+    int status;
+    size_t count;
+    size_t capacity;
+    unsigned char *array;
+} typedef DecompressSlot, *pDecompressSlot;
+
+#if __linux__
+// Frames are taken by workers in order, sink is called by the thread that started the job
+struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int format;
+    const unsigned char *data;
+    struct
+    {
+        size_t count;
+        size_t capacity;
+        pDecompressFrame array;
+    } frames;
+    pDecompressSlot slots;
+    size_t slots_count;
+    size_t next;     // Frame to be taken by next worker
+    size_t consumed; // Frames passed to sink
+    unsigned char failed;
+} typedef DecompressJob, *pDecompressJob;
+#endif // __linux__
+
+// Returns DECOMPRESS_* format of data starting with buff.
+// Zstandard is detected even when it cannot be decompressed, so it is never taken as plain data.
+int decompress_detect(const unsigned char *buff, size_t size);
+// Detects format of fd from current offset. Reads into buff (size >= DECOMPRESS_MAGIC_SIZE) until
+// DECOMPRESS_MAGIC_SIZE bytes or end of input, small regular file is read whole by one read.
+// Bytes read are returned in prefix_size and have to be passed on as the start of input.
+int decompress_detect_fd(int fd, unsigned char *buff, size_t size, size_t *prefix_size);
+// Decompresses fd to the end passing data to sink, prefix holds bytes already read from fd.
+// st is stat of fd or NULL, BGZF and multi frame zstd regular files are decompressed by workers threads on Linux.
+// Returns 0 or DECOMPRESS_ERROR_*.
+int decompress_fd(int fd, const struct stat *st, const unsigned char *prefix, size_t prefix_size, int format,
+                  size_t workers, DecompressSink sink, void *context);
+// Returns size of BGZF block starting with buff, 0 if it is not a BGZF block header
+static size_t decompress_bgzf_block_size(const unsigned char *buff, size_t size);
+// Returns size of next input block, 0 at the end
+static ssize_t decompress_read(pDecompressInput input, const unsigned char **block);
+static int decompress_stream(pDecompressInput input, int format, DecompressSink sink, void *context);
+static int decompress_stream_gzip(pDecompressInput input, unsigned char *out, DecompressSink sink, void *context);
+#ifdef DECOMPRESS_WITH_ZSTD
+static int decompress_stream_zstd(pDecompressInput input, unsigned char *out, DecompressSink sink, void *context);
+#endif // DECOMPRESS_WITH_ZSTD
+#if __linux__
+// Splits mapped input into frames, returns number of bytes covered by them
+static size_t decompress_split(pDecompressJob job, size_t size);
+static int decompress_frame(pDecompressJob job, z_streamp z, void *zstd, pDecompressFrame frame, pDecompressSlot slot);
+static void *decompress_worker(void *arg);
+// Decompresses regular file from prefix_size bytes before current offset, prefix is mapped again
+static int decompress_parallel(int fd, const struct stat *st, size_t prefix_size, int format, size_t workers,
+                               DecompressSink sink, void *context);
+#endif // __linux__
+
+// #define DECOMPRESS_HEADER_IMPLEMENTATION
+#ifdef DECOMPRESS_HEADER_IMPLEMENTATION
+
+int decompress_detect(const unsigned char *buff, size_t size)
+{
+    if (size >= 4 && buff[0] == 0x28 && buff[1] == 0xB5 && buff[2] == 0x2F && buff[3] == 0xFD)
+        return DECOMPRESS_ZSTD;
+    // Magic and deflate compression method
+    if (size >= 3 && buff[0] == 0x1F && buff[1] == 0x8B && buff[2] == 8)
+        return decompress_bgzf_block_size(buff, size) ? DECOMPRESS_BGZF : DECOMPRESS_GZIP;
+    return DECOMPRESS_NONE;
+}
+
+int decompress_detect_fd(int fd, unsigned char *buff, size_t size, size_t *prefix_size)
+{
+    ssize_t bytes_read;
+
+    // Input is not rewound, bytes read here are the start of data for the caller
+    *prefix_size = 0;
+    while (*prefix_size < DECOMPRESS_MAGIC_SIZE && (bytes_read = read(fd, buff + *prefix_size, size - *prefix_size)) != 0)
+    {
+        if (bytes_read == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        *prefix_size += bytes_read;
+    }
+    return decompress_detect(buff, *prefix_size);
+}
+
+int decompress_fd(int fd, const struct stat *st, const unsigned char *prefix, size_t prefix_size, int format,
+                  size_t workers, DecompressSink sink, void *context)
+{
+    DecompressInput input = {.fd = fd, .prefix = prefix, .prefix_size = prefix_size};
+    int status;
+
+#ifndef DECOMPRESS_WITH_ZSTD
+    if (format == DECOMPRESS_ZSTD)
+        return DECOMPRESS_ERROR_UNSUPPORTED;
+#endif // DECOMPRESS_WITH_ZSTD
+#if __linux__
+    // Input that was read whole while detecting format gains nothing from workers
+    if (workers > 1 && (format == DECOMPRESS_BGZF || format == DECOMPRESS_ZSTD) && st && S_ISREG(st->st_mode) &&
+        st->st_size > (off_t)prefix_size)
+        return decompress_parallel(fd, st, prefix_size, format, workers, sink, context);
+#endif // __linux__
+
+    if (!(input.buff = malloc(DECOMPRESS_IN_SIZE)))
+        report_error_and_exit("cannot allocate memory for decompression\n");
+    status = decompress_stream(&input, format, sink, context);
+    free(input.buff);
+    return status;
+}
+
+static size_t decompress_bgzf_block_size(const unsigned char *buff, size_t size)
+{
+    size_t extra_end, length;
+
+    // FEXTRA flag is required
+    if (size < DECOMPRESS_MAGIC_SIZE || buff[0] != 0x1F || buff[1] != 0x8B || buff[2] != 8 || !(buff[3] & 4))
+        return 0;
+    extra_end = 12 + (buff[10] | buff[11] << 8);
+    for (size_t offset = 12; offset + 4 <= extra_end && offset + 4 <= size; offset += 4 + length)
+    {
+        length = buff[offset + 2] | buff[offset + 3] << 8;
+        // BSIZE is total block size minus 1
+        if (buff[offset] == 'B' && buff[offset + 1] == 'C' && length == 2 && offset + 6 <= size)
+            return (buff[offset + 4] | buff[offset + 5] << 8) + 1;
+    }
+    return 0;
+}
+
+static ssize_t decompress_read(pDecompressInput input, const unsigned char **block)
+{
+    ssize_t bytes_read;
+
+    if (input->prefix_size)
+    {
+        *block = input->prefix;
+        bytes_read = input->prefix_size;
+        input->prefix_size = 0;
+        return bytes_read;
+    }
+    if (input->fd == -1)
+        return 0;
+    while ((bytes_read = read(input->fd, input->buff, DECOMPRESS_IN_SIZE)) == -1 && errno == EINTR)
+        ;
+    *block = input->buff;
+    return bytes_read;
+}
+
+static int decompress_stream(pDecompressInput input, int format, DecompressSink sink, void *context)
+{
+    unsigned char *out = malloc(DECOMPRESS_OUT_SIZE);
+    int status = DECOMPRESS_ERROR_DATA;
+
+    if (!out)
+        report_error_and_exit("cannot allocate memory for decompression\n");
+    if (format == DECOMPRESS_GZIP || format == DECOMPRESS_BGZF)
+        status = decompress_stream_gzip(input, out, sink, context);
+#ifdef DECOMPRESS_WITH_ZSTD
+    else if (format == DECOMPRESS_ZSTD)
+        status = decompress_stream_zstd(input, out, sink, context);
+#endif // DECOMPRESS_WITH_ZSTD
+    free(out);
+    return status;
+}
+
+static int decompress_stream_gzip(pDecompressInput input, unsigned char *out, DecompressSink sink, void *context)
+{
+    const unsigned char *block;
+    unsigned char in_member = 0;
+    size_t members = 0;
+    ssize_t bytes_read;
+    z_stream z = {0};
+    int ret, status = 0;
+
+    // Gzip header only, concatenated members are decompressed one after another
+    if (inflateInit2(&z, 15 + 16) != Z_OK)
+        report_error_and_exit("cannot initialize zlib\n");
+    while (!status && (bytes_read = decompress_read(input, &block)) > 0)
+    {
+        z.next_in = (unsigned char *)block;
+        z.avail_in = bytes_read;
+        do
+        {
+            z.next_out = out;
+            z.avail_out = DECOMPRESS_OUT_SIZE;
+            ret = inflate(&z, Z_NO_FLUSH);
+            if (ret == Z_OK)
+                in_member = 1;
+            else if (ret == Z_STREAM_END)
+            {
+                members++;
+                in_member = 0;
+                inflateReset(&z);
+            }
+            else if (ret != Z_BUF_ERROR)
+            {
+                // Trailing garbage after last member is ignored, as gzip does
+                status = members && !z.total_out ? 0 : DECOMPRESS_ERROR_DATA;
+                in_member = 0;
+                bytes_read = 0;
+                break;
+            }
+            sink(context, out, DECOMPRESS_OUT_SIZE - z.avail_out);
+        } while (z.avail_in || !z.avail_out);
+        if (!bytes_read)
+            break;
+    }
+    if (bytes_read == -1)
+        status = DECOMPRESS_ERROR_READ;
+    else if (in_member)
+        status = DECOMPRESS_ERROR_DATA;
+    inflateEnd(&z);
+    return status;
+}
+
+#ifdef DECOMPRESS_WITH_ZSTD
+static int decompress_stream_zstd(pDecompressInput input, unsigned char *out, DecompressSink sink, void *context)
+{
+    ZSTD_DStream *stream = ZSTD_createDStream();
+    ZSTD_outBuffer zout;
+    ZSTD_inBuffer zin;
+    const unsigned char *block;
+    ssize_t bytes_read;
+    size_t ret = 0;
+    int status = 0;
+
+    if (!stream)
+        report_error_and_exit("cannot initialize zstd\n");
+    ZSTD_initDStream(stream);
+    while (!status && (bytes_read = decompress_read(input, &block)) > 0)
+    {
+        zin.src = block;
+        zin.size = bytes_read;
+        zin.pos = 0;
+        do
+        {
+            zout.dst = out;
+            zout.size = DECOMPRESS_OUT_SIZE;
+            zout.pos = 0;
+            ret = ZSTD_decompressStream(stream, &zout, &zin);
+            if (ZSTD_isError(ret))
+            {
+                status = DECOMPRESS_ERROR_DATA;
+                break;
+            }
+            sink(context, out, zout.pos);
+        } while (zin.pos < zin.size || zout.pos == zout.size);
+    }
+    if (bytes_read == -1)
+        status = DECOMPRESS_ERROR_READ;
+    else if (!status && ret)
+        status = DECOMPRESS_ERROR_DATA; // Input ends inside a frame
+    ZSTD_freeDStream(stream);
+    return status;
+}
+#endif // DECOMPRESS_WITH_ZSTD
+
+#if __linux__
+
+static size_t decompress_split(pDecompressJob job, size_t size)
+{
+    const unsigned char *data = job->data;
+    DecompressFrame frame;
+    size_t offset = 0;
+
+    while (offset < size)
+    {
+        frame.offset = offset;
+        if (job->format == DECOMPRESS_BGZF)
+        {
+            // Header, empty deflate block and trailer take at least 28 bytes
+            frame.size = decompress_bgzf_block_size(data + offset, size - offset);
+            if (frame.size < 28 || frame.size > size - offset)
+                break;
+            // ISIZE of the member trailer
+            frame.output_size = (size_t)data[offset + frame.size - 4] | (size_t)data[offset + frame.size - 3] << 8 |
+                                (size_t)data[offset + frame.size - 2] << 16 | (size_t)data[offset + frame.size - 1] << 24;
+        }
+#ifdef DECOMPRESS_WITH_ZSTD
+        else if (job->format == DECOMPRESS_ZSTD)
+        {
+            unsigned long long content_size;
+
+            frame.size = ZSTD_findFrameCompressedSize(data + offset, size - offset);
+            if (ZSTD_isError(frame.size))
+                break;
+            content_size = ZSTD_getFrameContentSize(data + offset, size - offset);
+            if (content_size == ZSTD_CONTENTSIZE_UNKNOWN || content_size == ZSTD_CONTENTSIZE_ERROR)
+                break;
+            frame.output_size = content_size;
+        }
+#endif // DECOMPRESS_WITH_ZSTD
+        else
+            break;
+        if (frame.output_size > DECOMPRESS_FRAME_LIMIT)
+            break;
+        append(DecompressFrame, job->frames, frame);
+        offset += frame.size;
+    }
+    return offset;
+}
+
+static int decompress_frame(pDecompressJob job, z_streamp z, void *zstd, pDecompressFrame frame, pDecompressSlot slot)
+{
+    // One byte more keeps output pointer valid for empty frames
+    if (slot->capacity < frame->output_size + 1)
+    {
+        slot->capacity = frame->output_size + 1;
+        if (!(slot->array = realloc(slot->array, slot->capacity)))
+            report_error_and_exit("cannot allocate memory for decompression\n");
+    }
+    slot->count = 0;
+
+    if (job->format == DECOMPRESS_BGZF)
+    {
+        inflateReset(z);
+        z->next_in = (unsigned char *)job->data + frame->offset;
+        z->avail_in = frame->size;
+        z->next_out = slot->array;
+        z->avail_out = slot->capacity;
+        if (inflate(z, Z_FINISH) != Z_STREAM_END)
+            return DECOMPRESS_ERROR_DATA;
+        slot->count = slot->capacity - z->avail_out;
+        return 0;
+    }
+#ifdef DECOMPRESS_WITH_ZSTD
+    if (job->format == DECOMPRESS_ZSTD)
+    {
+        size_t ret = ZSTD_decompressDCtx(zstd, slot->array, slot->capacity, job->data + frame->offset, frame->size);
+        if (ZSTD_isError(ret))
+            return DECOMPRESS_ERROR_DATA;
+        slot->count = ret;
+        return 0;
+    }
+#endif // DECOMPRESS_WITH_ZSTD
+    return DECOMPRESS_ERROR_DATA;
+}
+
+static void *decompress_worker(void *arg)
+{
+    pDecompressJob job = arg;
+    pDecompressSlot slot;
+    z_stream z = {0};
+    void *zstd = NULL;
+    size_t index;
+    int status;
+
+    if (job->format == DECOMPRESS_BGZF && inflateInit2(&z, 15 + 16) != Z_OK)
+        report_error_and_exit("cannot initialize zlib\n");
+#ifdef DECOMPRESS_WITH_ZSTD
+    if (job->format == DECOMPRESS_ZSTD && !(zstd = ZSTD_createDCtx()))
+        report_error_and_exit("cannot initialize zstd\n");
+#endif // DECOMPRESS_WITH_ZSTD
+
+    pthread_mutex_lock(&job->lock);
+    while (1)
+    {
+        // Slot is reused only after the frame it holds was consumed
+        while (!job->failed && job->next < job->frames.count && job->next >= job->consumed + job->slots_count)
+            pthread_cond_wait(&job->cond, &job->lock);
+        if (job->failed || job->next >= job->frames.count)
+            break;
+        index = job->next++;
+        pthread_mutex_unlock(&job->lock);
+
+        slot = &job->slots[index % job->slots_count];
+        status = decompress_frame(job, &z, zstd, &job->frames.array[index], slot);
+
+        pthread_mutex_lock(&job->lock);
+        slot->status = status;
+        slot->ready = index + 1;
+        pthread_cond_broadcast(&job->cond);
+    }
+    pthread_mutex_unlock(&job->lock);
+
+    if (job->format == DECOMPRESS_BGZF)
+        inflateEnd(&z);
+#ifdef DECOMPRESS_WITH_ZSTD
+    ZSTD_freeDCtx(zstd);
+#endif // DECOMPRESS_WITH_ZSTD
+    return NULL;
+}
+
+static int decompress_parallel(int fd, const struct stat *st, size_t prefix_size, int format, size_t workers,
+                               DecompressSink sink, void *context)
+{
+    DecompressJob job = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER, .format = format};
+    DecompressInput input = {.fd = -1};
+    pthread_t *threads;
+    pDecompressSlot slot;
+    unsigned char *map;
+    size_t size, covered;
+    off_t offset;
+    int status = 0;
+
+    if ((offset = lseek(fd, 0, SEEK_CUR)) == -1 || (offset -= prefix_size) < 0 || offset >= st->st_size)
+        return DECOMPRESS_ERROR_READ;
+    size = st->st_size - offset;
+    map = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return DECOMPRESS_ERROR_READ;
+    madvise(map, st->st_size, MADV_SEQUENTIAL);
+    job.data = map + offset;
+
+    covered = decompress_split(&job, size);
+    if (job.frames.count > 1)
+    {
+        if (workers > job.frames.count)
+            workers = job.frames.count;
+        job.slots_count = workers * DECOMPRESS_SLOTS_PER_WORKER;
+        job.slots = calloc(job.slots_count, sizeof(DecompressSlot));
+        threads = calloc(workers, sizeof(pthread_t));
+        if (!job.slots || !threads)
+            report_error_and_exit("cannot allocate memory for decompression\n");
+        for (size_t i = 0; i < workers; ++i)
+            if (pthread_create(&threads[i], NULL, decompress_worker, &job))
+                report_error_and_exit("cannot create decompression thread\n");
+
+        for (size_t i = 0; i < job.frames.count; ++i)
+        {
+            slot = &job.slots[i % job.slots_count];
+            pthread_mutex_lock(&job.lock);
+            while (slot->ready != i + 1)
+                pthread_cond_wait(&job.cond, &job.lock);
+            pthread_mutex_unlock(&job.lock);
+            if ((status = slot->status))
+                break;
+            sink(context, slot->array, slot->count);
+
+            pthread_mutex_lock(&job.lock);
+            job.consumed = i + 1;
+            pthread_cond_broadcast(&job.cond);
+            pthread_mutex_unlock(&job.lock);
+        }
+
+        pthread_mutex_lock(&job.lock);
+        job.failed = status != 0;
+        pthread_cond_broadcast(&job.cond);
+        pthread_mutex_unlock(&job.lock);
+        for (size_t i = 0; i < workers; ++i)
+            pthread_join(threads[i], NULL);
+        for (size_t i = 0; i < job.slots_count; ++i)
+            free(job.slots[i].array);
+        free(job.slots);
+        free(threads);
+    }
+    else
+        covered = 0; // Single frame gains nothing from workers
+
+    // Rest that could not be split is streamed from the mapping
+    if (!status && covered < size)
+    {
+        input.prefix = job.data + covered;
+        input.prefix_size = size - covered;
+        status = decompress_stream(&input, format, sink, context);
+    }
+
+    free_array(job.frames);
+    munmap(map, st->st_size);
+    lseek(fd, 0, SEEK_END);
+    return status;
+}
+
+#endif // __linux__
+
+#endif // DECOMPRESS_HEADER_IMPLEMENTATION
+
+#endif // DECOMPRESS_HEADER
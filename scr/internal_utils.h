@@ -1,5 +1,7 @@
 #include "stdio.h"
 #include "stdlib.h"
+#include <errno.h>
+#include <stdint.h>
 #include "dynamic_array.h"
 
 #ifndef INTERNAL_UTILS
@@ -24,6 +26,10 @@ int read_line_to_buff(unsigned char *buff, size_t buff_max_size, size_t *bytes_r
 // Expects buffer to be dynamic array
 int read_line(puCharArray buff, size_t *bytes_read, FILE *f);
 
+// Parses size in bytes with optional K, M or G suffix (powers of 1024).
+// Returns 0 if string is not a valid size.
+size_t parse_size(const char *str);
+
 // Prints error message to stderr, finish program with 11 status code
 #define report_error_and_exit(format, error_msg...) \
     do                                              \
@@ -83,6 +89,36 @@ int read_line(puCharArray buff, size_t *bytes_read, FILE *f)
     return c;
 }
 
+size_t parse_size(const char *str)
+{
+    char *end;
+    unsigned long long size;
+    int shift = 0;
+
+    if (!str || *str < '0' || *str > '9')
+        return 0;
+    errno = 0;
+    size = strtoull(str, &end, 10);
+    if (errno == ERANGE || size > SIZE_MAX)
+        return 0;
+    switch (*end)
+    {
+    case 'G':
+        shift += 10;
+        // fall through
+    case 'M':
+        shift += 10;
+        // fall through
+    case 'K':
+        shift += 10;
+        end++;
+    }
+    // Value that does not fit after suffix is applied is rejected as wrong
+    if (size > SIZE_MAX >> shift)
+        return 0;
+    return *end == '\0' ? size << shift : 0;
+}
+
 #endif // INTERNAL_UTILS_IMPLEMENTATION
 
 #endif // INTERNAL_UTILS
\ No newline at end of file
@@ -1,6 +1,10 @@
+#define _GNU_SOURCE
 #include "string.h"
 #define INTERNAL_UTILS_IMPLEMENTATION
 #define ARGPARSE_HEADER_IMPLEMENTATION
+#define OUTPUT_HEADER_IMPLEMENTATION
+#define UTF8_HEADER_IMPLEMENTATION
+#define DECOMPRESS_HEADER_IMPLEMENTATION
 #define WC_HEADER_IMPLEMENTATION
 #include "wc.h"
 #define TEE_HEADER_IMPLEMENTATION
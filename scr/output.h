@@ -0,0 +1,294 @@
+#include "stdlib.h"
+#include "string.h"
+#include "internal_utils.h"
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef OUTPUT_HEADER
+#define OUTPUT_HEADER
+
+#define OUTPUT_BUFFER_SIZE (1 << 16)
+// Buffer is flushed when record ends and less than this is left, so record up to this size is never split
+// between two writes. Fits path of PATH_MAX bytes escaped in JSON to 6 bytes each, with other fields.
+#define OUTPUT_RECORD_RESERVE (6 * PATH_MAX + 1024)
+
+#define OUTPUT_PLAIN 0 // Fields joined with delimiter, keys are not printed
+#define OUTPUT_TSV 1   // Fields joined with tab
+#define OUTPUT_JSON 2  // JSON object per line
+
+#ifdef CLOCK_MONOTONIC_COARSE
+#define OUTPUT_CLOCK CLOCK_MONOTONIC_COARSE
+#else
+#define OUTPUT_CLOCK CLOCK_MONOTONIC
+#endif // CLOCK_MONOTONIC_COARSE
+
+// Buffered record writer, does not allocate and does not use stdio
+struct
+{
+    int fd;
+    unsigned char format;
+    char *delimiter;
+    size_t delimiter_length;
+    long flush_interval_ms; // Time after which finished records are flushed, 0 flushes every record
+    struct timespec last_flush;
+    pthread_mutex_t *lock; // Set when several outputs share one fd, keeps flushed blocks whole
+    size_t fields;         // Fields in current record
+    size_t count;
+    unsigned char array[OUTPUT_BUFFER_SIZE];
+} typedef Output, *pOutput;
+
+// Delimiter is used by OUTPUT_PLAIN only
+void output_init(pOutput out, int fd, unsigned char format, char *delimiter, long flush_interval_ms);
+// Returns OUTPUT_* for format name or -1 if not known
+int output_parse_format(const char *name);
+void output_bytes(pOutput out, const char *buff, size_t size);
+void output_str(pOutput out, const char *str);
+void output_uint(pOutput out, unsigned long long value);
+void output_field_uint(pOutput out, const char *key, unsigned long long value);
+void output_field_str(pOutput out, const char *key, const char *value);
+// Finishes line, flushes if buffer is nearly full or flush interval passed
+void output_end_record(pOutput out);
+void output_flush(pOutput out);
+// Returns nanoseconds until buffered records are due to be flushed, 0 if they are due, -1 if buffer is empty.
+// Lets caller that is about to block flush on time when no record ends to trigger it.
+long long output_flush_due_ns(pOutput out);
+static void output_field_begin(pOutput out, const char *key);
+// Writes JSON string, bytes of ill-formed UTF-8 are replaced with U+FFFD
+static void output_json_str(pOutput out, const char *str);
+// Returns length of well-formed UTF-8 sequence starting with byte >= 0x80, 0 if it is ill-formed
+static size_t output_utf8_length(const unsigned char *str);
+
+#ifdef OUTPUT_HEADER_IMPLEMENTATION
+
+static const char output_digit_pairs[201] = "00010203040506070809"
+                                            "10111213141516171819"
+                                            "20212223242526272829"
+                                            "30313233343536373839"
+                                            "40414243444546474849"
+                                            "50515253545556575859"
+                                            "60616263646566676869"
+                                            "70717273747576777879"
+                                            "80818283848586878889"
+                                            "90919293949596979899";
+
+void output_init(pOutput out, int fd, unsigned char format, char *delimiter, long flush_interval_ms)
+{
+    out->fd = fd;
+    out->format = format;
+    out->delimiter = delimiter ? delimiter : "\t";
+    out->delimiter_length = strlen(out->delimiter);
+    out->flush_interval_ms = flush_interval_ms;
+    out->fields = out->count = 0;
+    out->lock = NULL;
+    clock_gettime(OUTPUT_CLOCK, &out->last_flush);
+}
+
+int output_parse_format(const char *name)
+{
+    if (!strcmp(name, "plain"))
+        return OUTPUT_PLAIN;
+    if (!strcmp(name, "tsv"))
+        return OUTPUT_TSV;
+    if (!strcmp(name, "json"))
+        return OUTPUT_JSON;
+    return -1;
+}
+
+void output_flush(pOutput out)
+{
+    unsigned char *buff = out->array;
+    ssize_t bytes_wrote;
+
+    if (out->lock)
+        pthread_mutex_lock(out->lock);
+    while (out->count)
+    {
+        bytes_wrote = write(out->fd, buff, out->count);
+        if (bytes_wrote == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            report_error_and_exit("cannot write output\n");
+        }
+        buff += bytes_wrote;
+        out->count -= bytes_wrote;
+    }
+    if (out->lock)
+        pthread_mutex_unlock(out->lock);
+    clock_gettime(OUTPUT_CLOCK, &out->last_flush);
+}
+
+long long output_flush_due_ns(pOutput out)
+{
+    struct timespec now;
+    long long elapsed_ns;
+
+    if (!out->count)
+        return -1;
+    if (!out->flush_interval_ms)
+        return 0;
+    clock_gettime(OUTPUT_CLOCK, &now);
+    elapsed_ns = (now.tv_sec - out->last_flush.tv_sec) * 1000000000LL + (now.tv_nsec - out->last_flush.tv_nsec);
+    return elapsed_ns >= out->flush_interval_ms * 1000000LL ? 0 : out->flush_interval_ms * 1000000LL - elapsed_ns;
+}
+
+void output_bytes(pOutput out, const char *buff, size_t size)
+{
+    if (out->count + size > OUTPUT_BUFFER_SIZE)
+    {
+        output_flush(out);
+        if (size > OUTPUT_BUFFER_SIZE)
+        {
+            memcpy(out->array, buff, OUTPUT_BUFFER_SIZE);
+            out->count = OUTPUT_BUFFER_SIZE;
+            output_flush(out);
+            output_bytes(out, buff + OUTPUT_BUFFER_SIZE, size - OUTPUT_BUFFER_SIZE);
+            return;
+        }
+    }
+    memcpy(out->array + out->count, buff, size);
+    out->count += size;
+}
+
+void output_str(pOutput out, const char *str)
+{
+    output_bytes(out, str, strlen(str));
+}
+
+void output_uint(pOutput out, unsigned long long value)
+{
+    char digits[20];
+    char *p = digits + sizeof(digits);
+
+    // Two digits per division
+    while (value >= 100)
+    {
+        unsigned int pair = (value % 100) * 2;
+        value /= 100;
+        *--p = output_digit_pairs[pair + 1];
+        *--p = output_digit_pairs[pair];
+    }
+    if (value >= 10)
+    {
+        *--p = output_digit_pairs[value * 2 + 1];
+        *--p = output_digit_pairs[value * 2];
+    }
+    else
+        *--p = '0' + value;
+    output_bytes(out, p, digits + sizeof(digits) - p);
+}
+
+static size_t output_utf8_length(const unsigned char *str)
+{
+    size_t length = str[0] < 0xC2 ? 0 : str[0] < 0xE0 ? 2 : str[0] < 0xF0 ? 3 : str[0] < 0xF5 ? 4 : 0;
+    // Second byte excludes overlong forms, surrogates and code points above U+10FFFF
+    unsigned char lower = str[0] == 0xE0 ? 0xA0 : str[0] == 0xF0 ? 0x90 : 0x80;
+    unsigned char upper = str[0] == 0xED ? 0x9F : str[0] == 0xF4 ? 0x8F : 0xBF;
+
+    if (!length || str[1] < lower || str[1] > upper)
+        return 0;
+    for (size_t i = 2; i < length; ++i)
+        if ((str[i] & 0xC0) != 0x80)
+            return 0;
+    return length;
+}
+
+static void output_json_str(pOutput out, const char *str)
+{
+    static const char hex[] = "0123456789abcdef";
+    const char *begin = str;
+    char escaped[6] = {'\\', 'u', '0', '0'};
+    size_t length;
+
+    output_bytes(out, "\"", 1);
+    for (; *str; ++str)
+    {
+        unsigned char c = *str;
+        if (c >= 0x80 && (length = output_utf8_length((const unsigned char *)str)))
+        {
+            str += length - 1;
+            continue;
+        }
+        if (c >= 0x20 && c < 0x80 && c != '"' && c != '\\')
+            continue;
+        output_bytes(out, begin, str - begin);
+        if (c >= 0x80)
+            output_bytes(out, "\\ufffd", 6);
+        else if (c == '"' || c == '\\')
+        {
+            escaped[1] = c;
+            output_bytes(out, escaped, 2);
+            escaped[1] = 'u';
+        }
+        else
+        {
+            escaped[4] = hex[c >> 4];
+            escaped[5] = hex[c & 0xF];
+            output_bytes(out, escaped, 6);
+        }
+        begin = str + 1;
+    }
+    output_bytes(out, begin, str - begin);
+    output_bytes(out, "\"", 1);
+}
+
+static void output_field_begin(pOutput out, const char *key)
+{
+    switch (out->format)
+    {
+    case OUTPUT_JSON:
+        output_bytes(out, out->fields ? "," : "{", 1);
+        output_json_str(out, key);
+        output_bytes(out, ":", 1);
+        break;
+    case OUTPUT_TSV:
+        if (out->fields)
+            output_bytes(out, "\t", 1);
+        break;
+    default:
+        if (out->fields)
+            output_bytes(out, out->delimiter, out->delimiter_length);
+    }
+    out->fields++;
+}
+
+void output_field_uint(pOutput out, const char *key, unsigned long long value)
+{
+    output_field_begin(out, key);
+    output_uint(out, value);
+}
+
+void output_field_str(pOutput out, const char *key, const char *value)
+{
+    output_field_begin(out, key);
+    if (out->format == OUTPUT_JSON)
+        output_json_str(out, value);
+    else
+        output_str(out, value);
+}
+
+void output_end_record(pOutput out)
+{
+    struct timespec now;
+
+    if (out->format == OUTPUT_JSON && out->fields)
+        output_bytes(out, "}", 1);
+    output_bytes(out, "\n", 1);
+    out->fields = 0;
+
+    if (out->count > OUTPUT_BUFFER_SIZE - OUTPUT_RECORD_RESERVE || !out->flush_interval_ms)
+    {
+        output_flush(out);
+        return;
+    }
+    clock_gettime(OUTPUT_CLOCK, &now);
+    if ((now.tv_sec - out->last_flush.tv_sec) * 1000 + (now.tv_nsec - out->last_flush.tv_nsec) / 1000000 >= out->flush_interval_ms)
+        output_flush(out);
+}
+
+#endif // OUTPUT_HEADER_IMPLEMENTATION
+
+#endif // OUTPUT_HEADER
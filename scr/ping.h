@@ -8,6 +8,7 @@
 #include "internal_utils.h"
 #include "dynamic_array.h"
 #include "argparse.h"
+#include "output.h"
 #include "limits.h"
 
 #ifndef PING_HEADER
@@ -20,10 +21,103 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <linux/filter.h>
 
 static int send_icmp_echo_request(int icmp_socket, uCharArray *payload, struct addrinfo *dst_addrinfo, unsigned short n);
-static int receive_echo_reply(int icmp_socket, uCharArray *payload, struct addrinfo *dst_addrinfo);
-static int linux_ping_cycle(char *dst, uCharArray *payload, unsigned short n);
+static int receive_echo_reply(int icmp_socket, uCharArray *payload, struct addrinfo *dst_addrinfo, pOutput out);
+// Waits until socket is readable, flushing buffered records once they are due
+static void ping_wait_reply(int icmp_socket, pOutput out);
+static int linux_ping_cycle(char *dst, uCharArray *payload, unsigned short n, pOutput out);
+
+#define PING_SWEEP_ROUNDS 4 // Feistel rounds of address permutation
+#define PING_SWEEP_RECEIVE_BUFFER (1 << 22)
+// Latency histogram has 2^PING_LATENCY_SUB_BITS linear buckets per power of two microseconds
+#define PING_LATENCY_SUB_BITS 4
+#define PING_LATENCY_BUCKETS ((64 - PING_LATENCY_SUB_BITS + 1) << PING_LATENCY_SUB_BITS)
+
+// Inclusive range of IPv4 addresses in host byte order
+struct
+{
+  uint32_t first;
+  uint32_t last;
+  size_t offset; // Index of first address among all ranges
+} typedef PingRange, *pPingRange;
+
+// Addresses are generated on the fly in permuted order, replies are tracked in bitmap indexed like addresses
+struct
+{
+  struct
+  {
+    size_t count;
+    size_t capacity;
+    pPingRange array;
+  } ranges; // Sorted and not overlapping
+  size_t total;
+  // Index is permuted over [0, 2^(2 * half_bits)), values not less than total are skipped
+  unsigned int half_bits;
+  uint32_t keys[PING_SWEEP_ROUNDS];
+  unsigned char *replied; // Updated atomically, shards reply to disjoint addresses but share bytes
+  unsigned char benchmark; // Responders are not printed
+  size_t shards_count;
+  double rate;       // Requests per second of one shard
+  long timeout_ms;
+} typedef PingSweep, *pPingSweep;
+
+// Statistics of one shard, merged when shards finish
+struct
+{
+  size_t sent;
+  size_t alive;
+  size_t duplicates;
+  size_t mismatched; // Reply with our id but sequence or timestamp not matching the address
+  long long first_sent_ns;
+  long long last_reply_ns;
+  unsigned long long max_latency_us;
+  size_t latencies[PING_LATENCY_BUCKETS];
+} typedef PingStats, *pPingStats;
+
+// Sweep worker with own socket, send schedule and echo id, so kernel demultiplexes replies between shards
+struct
+{
+  pPingSweep sweep;
+  int icmp_socket;
+  unsigned short id;
+  int cpu;     // Worker is pinned to it, -1 to run anywhere
+  size_t next; // Next permutation input, shard k takes inputs k, k + shards_count, ...
+  pOutput out;
+  Output output; // Used by out when there are several shards
+  PingStats stats;
+} typedef PingShard, *pPingShard;
+
+// Parses CIDR block (10.0.0.0/16), range (10.0.0.1-10.0.0.254) or single address, returns 0 on success
+static int ping_parse_range(const char *target, pPingRange range);
+// Merges parsed ranges, sets up permutation and bitmap
+static void ping_sweep_init(pPingSweep sweep);
+static size_t ping_sweep_permute(pPingSweep sweep, size_t index);
+// Sets next address of shard to probe, returns 0 when all its addresses were generated
+static int ping_sweep_next(pPingShard shard, uint32_t *address, size_t *index);
+// Returns index of address or -1 if it is not swept
+static long long ping_sweep_index(pPingSweep sweep, uint32_t address);
+// Sends echo request with send time as payload, so replies need no per address state
+static int ping_sweep_send(int icmp_socket, uint32_t address, unsigned short id, unsigned short sequence);
+// Reads all queued replies, new responders are reported
+static void ping_sweep_receive(pPingShard shard);
+// Raw socket passing only echo replies with given id, filtered in kernel
+static int ping_sweep_socket(unsigned short id);
+// Sends shard requests paced with token bucket and receives replies until timeout after last request
+static void *ping_sweep_worker(void *arg);
+static void ping_merge_stats(pPingStats total, pPingStats stats);
+static long long ping_now_ns(void);
+static size_t ping_latency_bucket(unsigned long long us);
+// Returns highest latency in bucket
+static unsigned long long ping_latency_bucket_high(size_t bucket);
+// Returns latency not exceeded by given fraction of replies
+static unsigned long long ping_latency_percentile(pPingStats stats, double fraction);
+static void ping_report_benchmark(pOutput out, pPingStats stats);
 
 #elif _WIN32
 #endif // __linux__ || _WIN32
@@ -34,19 +128,35 @@ static int linux_ping_cycle(char *dst, uCharArray *payload, unsigned short n);
 static unsigned short csum(unsigned short *buf, int nwords);
 static void word_pad(unsigned char *buff, size_t payload_size, size_t *required_size, char pad_byte);
 static int ping_implementation(pArglist arg_list);
+static void ping_report_sent(pOutput out, char *dst, char *resolved_addr, size_t icmp_sequence);
+static void ping_report_reply(pOutput out, size_t icmp_sequence, long ms);
+static void ping_report_alive(pOutput out, char *addr, long long us);
+static void ping_report_sweep_summary(pOutput out, size_t sent, size_t alive);
+// targets   - CIDR blocks, ranges or addresses, see ping_parse_range
+// rate      - Requests per second
+// benchmark - Print throughput, latency percentiles and matching errors instead of responders
+// workers   - Number of shards, each in own thread pinned to a CPU
+int ping_sweep(char **targets, size_t targets_count, double rate, long timeout_ms, unsigned char benchmark, size_t workers, pOutput out);
 // dst     - IPv4 address or domain name
 // payload - Optional data to send with echo request
 // n       - Number of requests to send, set 0 to have infinite
-int ping_cycle(char *dst, uCharArray *payload, unsigned short n);
+// out     - Output for sent requests and received replies
+int ping_cycle(char *dst, uCharArray *payload, unsigned short n, pOutput out);
 int ping_main(int argc, char **argv);
 
 #ifdef PING_HEADER_IMPLEMENTATION
 
 int ping_main(int argc, char **argv)
 {
-  Arglist arg_list = {.footer_msg = "ping [options] destination"};
+  Arglist arg_list = {.footer_msg = "ping [options] destination\nping -S [options] CIDR|range|address..."};
   push_argument(&arg_list, (Argument){.key = "-h", .flag = IS_FLAG, .help_msg = "Prints this help message."});
   push_argument(&arg_list, (Argument){.key = "-n", .flag = ARG_OPTIONAL, .help_msg = "Times to ping. By default ping in infinite loop."});
+  push_argument(&arg_list, (Argument){.key = "-F", .flag = DEFAULT_VALUE, .help_msg = "Output format: plain, tsv or json.", .value = "plain"});
+  push_argument(&arg_list, (Argument){.key = "-S", .flag = IS_FLAG, .help_msg = "Sweep destinations given as CIDR blocks (10.0.0.0/16), ranges (10.0.0.1-10.0.0.254) or addresses, responders are printed as they reply."});
+  push_argument(&arg_list, (Argument){.key = "-r", .flag = DEFAULT_VALUE, .help_msg = "Sweep rate in requests per second.", .value = "1000"});
+  push_argument(&arg_list, (Argument){.key = "-B", .flag = IS_FLAG, .help_msg = "Benchmark sweep: print throughput, latency percentiles, duplicate and mismatched replies instead of responders."});
+  push_argument(&arg_list, (Argument){.key = "-j", .flag = DEFAULT_VALUE, .help_msg = "Sweep workers, each pinned to a CPU with own socket, echo id and share of destinations.", .value = "1"});
+  push_argument(&arg_list, (Argument){.key = "-W", .flag = DEFAULT_VALUE, .help_msg = "Time in ms to wait for replies after last sweep request.", .value = "1000"});
   parse_arguments(argc, argv, &arg_list);
   if (is_flag_set(&arg_list, "-h") || argc == 1)
   {
@@ -60,32 +170,218 @@ int ping_main(int argc, char **argv)
 
 int ping_implementation(pArglist arg_list)
 {
+  static Output out;
   unsigned long long times_to_ping = 1;
   size_t pos = 0;
   char *dst = get_next_positional_value(arg_list, &pos);
+  int format;
 
   if (!dst)
     report_error_and_exit("destination host is not provided\n");
+  if ((format = output_parse_format(get_value_by_key(arg_list, "-F"))) == -1)
+    report_error_and_exit("wrong value specified for -F '%s'\n", get_value_by_key(arg_list, "-F"));
+  // Terminal gets every line at once, pipes get batches at most a second old
+  output_init(&out, STDOUT_FILENO, format, NULL, isatty(STDOUT_FILENO) ? 0 : 1000);
 
-  if (is_value_set(arg_list, "-n"))
+  if (is_flag_set(arg_list, "-S"))
+  {
+    char *targets[arg_list->count];
+    size_t targets_count = 0;
+    double rate = strtod(get_value_by_key(arg_list, "-r"), NULL);
+    long timeout_ms = strtol(get_value_by_key(arg_list, "-W"), NULL, 10);
+    long workers = strtol(get_value_by_key(arg_list, "-j"), NULL, 10);
+
+    if (rate <= 0)
+      report_error_and_exit("wrong value specified for -r '%s'\n", get_value_by_key(arg_list, "-r"));
+    if (timeout_ms < 0)
+      report_error_and_exit("wrong value specified for -W '%s'\n", get_value_by_key(arg_list, "-W"));
+    if (workers <= 0 || workers > USHRT_MAX)
+      report_error_and_exit("wrong value specified for -j '%s'\n", get_value_by_key(arg_list, "-j"));
+    pos = 0;
+    while ((targets[targets_count] = get_next_positional_value(arg_list, &pos)) != NULL)
+      targets_count++;
+    ping_sweep(targets, targets_count, rate, timeout_ms, is_flag_set(arg_list, "-B") != 0, workers, &out);
+  }
+  else if (is_value_set(arg_list, "-n"))
   {
     times_to_ping = strtoull(get_value_by_key(arg_list, "-n"), NULL, 10);
     if (times_to_ping == 0)
       report_error_and_exit("wrong value specified for -n '%s'\n", get_value_by_key(arg_list, "-n"));
-    ping_cycle(dst, NULL, times_to_ping);
+    ping_cycle(dst, NULL, times_to_ping, &out);
   }
   else
   {
-    ping_cycle(dst, NULL, 0);
+    ping_cycle(dst, NULL, 0, &out);
   }
+  output_flush(&out);
 
   return 0;
 }
 
-int ping_cycle(char *dst, uCharArray *payload, unsigned short n)
+static void ping_report_sent(pOutput out, char *dst, char *resolved_addr, size_t icmp_sequence)
+{
+  if (out->format == OUTPUT_PLAIN)
+  {
+    output_str(out, "Sent request to ");
+    output_str(out, dst);
+    output_str(out, "(");
+    output_str(out, resolved_addr);
+    output_str(out, ") icmp_seq: ");
+    output_uint(out, icmp_sequence);
+  }
+  else
+  {
+    output_field_str(out, "event", "sent");
+    output_field_str(out, "host", dst);
+    output_field_str(out, "address", resolved_addr);
+    output_field_uint(out, "icmp_seq", icmp_sequence);
+  }
+  output_end_record(out);
+}
+
+static void ping_report_reply(pOutput out, size_t icmp_sequence, long ms)
+{
+  if (out->format == OUTPUT_PLAIN)
+  {
+    output_str(out, "Received reply in ");
+    output_uint(out, ms);
+    output_str(out, " ms for icmp_seq: ");
+    output_uint(out, icmp_sequence);
+  }
+  else
+  {
+    output_field_str(out, "event", "reply");
+    output_field_uint(out, "icmp_seq", icmp_sequence);
+    output_field_uint(out, "time_ms", ms);
+  }
+  output_end_record(out);
+}
+
+static void ping_report_alive(pOutput out, char *addr, long long us)
+{
+  if (out->format == OUTPUT_PLAIN)
+  {
+    output_str(out, "Reply from ");
+    output_str(out, addr);
+    output_str(out, " in ");
+    output_uint(out, us / 1000);
+    output_str(out, ".");
+    output_uint(out, us % 1000 / 100);
+    output_str(out, " ms");
+  }
+  else
+  {
+    output_field_str(out, "event", "alive");
+    output_field_str(out, "address", addr);
+    output_field_uint(out, "time_us", us);
+  }
+  output_end_record(out);
+}
+
+static void ping_report_sweep_summary(pOutput out, size_t sent, size_t alive)
+{
+  if (out->format == OUTPUT_PLAIN)
+  {
+    output_str(out, "Sweep finished, ");
+    output_uint(out, sent);
+    output_str(out, " requests sent, ");
+    output_uint(out, alive);
+    output_str(out, " hosts replied");
+  }
+  else
+  {
+    output_field_str(out, "event", "summary");
+    output_field_uint(out, "sent", sent);
+    output_field_uint(out, "alive", alive);
+  }
+  output_end_record(out);
+}
+
+int ping_sweep(char **targets, size_t targets_count, double rate, long timeout_ms, unsigned char benchmark, size_t workers, pOutput out)
 {
 #if __linux__
-  return linux_ping_cycle(dst, payload, n);
+  static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+  PingSweep sweep = {.benchmark = benchmark, .shards_count = workers, .rate = rate / workers, .timeout_ms = timeout_ms};
+  unsigned short base_id = getpid() & 0xffff;
+  pPingShard shards = calloc(workers, sizeof(PingShard));
+  pthread_t *threads = calloc(workers, sizeof(pthread_t));
+  PingStats total = {0};
+  PingRange range;
+  cpu_set_t cpus;
+  int cpu = -1;
+
+  if (!shards || !threads)
+    report_error_and_exit("cannot allocate memory for sweep workers\n");
+  for (size_t i = 0; i < targets_count; ++i)
+  {
+    if (ping_parse_range(targets[i], &range))
+      report_error_and_exit("wrong sweep destination '%s'\n", targets[i]);
+    append(PingRange, sweep.ranges, range);
+  }
+  if (!sweep.ranges.count)
+    report_error_and_exit("destination host is not provided\n");
+  ping_sweep_init(&sweep);
+
+  if (workers > 1 && sched_getaffinity(0, sizeof(cpus), &cpus) == -1)
+    CPU_ZERO(&cpus);
+  output_flush(out);
+  for (size_t i = 0; i < workers; ++i)
+  {
+    shards[i].sweep = &sweep;
+    shards[i].next = i;
+    shards[i].id = base_id + i; // Wraps around, ids stay distinct
+    shards[i].icmp_socket = ping_sweep_socket(shards[i].id);
+    shards[i].out = out;
+    shards[i].cpu = -1;
+    if (workers == 1)
+      continue;
+    // Shards take allowed CPUs round robin
+    if (CPU_COUNT(&cpus))
+    {
+      do
+        cpu = (cpu + 1) % CPU_SETSIZE;
+      while (!CPU_ISSET(cpu, &cpus));
+      shards[i].cpu = cpu;
+    }
+    output_init(&shards[i].output, out->fd, out->format, out->delimiter, out->flush_interval_ms);
+    shards[i].output.lock = &output_lock;
+    shards[i].out = &shards[i].output;
+  }
+
+  if (workers == 1)
+    ping_sweep_worker(&shards[0]);
+  else
+  {
+    for (size_t i = 0; i < workers; ++i)
+      if (pthread_create(&threads[i], NULL, ping_sweep_worker, &shards[i]))
+        report_error_and_exit("cannot create sweep worker\n");
+    for (size_t i = 0; i < workers; ++i)
+      pthread_join(threads[i], NULL);
+  }
+
+  for (size_t i = 0; i < workers; ++i)
+  {
+    ping_merge_stats(&total, &shards[i].stats);
+    close(shards[i].icmp_socket);
+  }
+  ping_report_sweep_summary(out, total.sent, total.alive);
+  if (benchmark)
+    ping_report_benchmark(out, &total);
+  free_array(sweep.ranges);
+  free(sweep.replied);
+  free(shards);
+  free(threads);
+  return 0;
+#else
+  report_error_and_exit("Platform not supported");
+#endif // __linux__
+  return 1;
+}
+
+int ping_cycle(char *dst, uCharArray *payload, unsigned short n, pOutput out)
+{
+#if __linux__
+  return linux_ping_cycle(dst, payload, n, out);
 #elif _WIN32
   report_error_and_exit("Not implemented");
 #else
@@ -119,7 +415,7 @@ static void word_pad(unsigned char *buff, size_t payload_size, size_t *required_
 
 #if __linux__
 
-static int linux_ping_cycle(char *dst, uCharArray *payload, unsigned short n)
+static int linux_ping_cycle(char *dst, uCharArray *payload, unsigned short n, pOutput out)
 {
   struct addrinfo in_addr = {0};
   struct addrinfo *dst_addrinfo;
@@ -149,13 +445,13 @@ static int linux_ping_cycle(char *dst, uCharArray *payload, unsigned short n)
     for (size_t i = 0; i < n; ++i)
     {
       send_icmp_echo_request(icmp_socket, payload, dst_addrinfo, i);
-      printf("Sent request to %s(%s) icmp_seq: %zu\n", dst, resolved_addr_str, i);
+      ping_report_sent(out, dst, resolved_addr_str, i);
       clock_gettime(CLOCK_MONOTONIC, &start);
-      while (i != receive_echo_reply(icmp_socket, payload, dst_addrinfo))
+      while (i != receive_echo_reply(icmp_socket, payload, dst_addrinfo, out))
         ;
       clock_gettime(CLOCK_MONOTONIC, &end);
       long ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
-      printf("Received reply in %ld ms for icmp_seq: %zu\n", ms, i);
+      ping_report_reply(out, i, ms);
     }
   }
   else
@@ -163,13 +459,13 @@ static int linux_ping_cycle(char *dst, uCharArray *payload, unsigned short n)
     for (size_t i = 0; i < USHRT_MAX; ++i)
     {
       send_icmp_echo_request(icmp_socket, payload, dst_addrinfo, i);
-      printf("Sent request to %s(%s) icmp_seq: %zu\n", dst, resolved_addr_str, i);
+      ping_report_sent(out, dst, resolved_addr_str, i);
       clock_gettime(CLOCK_MONOTONIC, &start);
-      while (i != receive_echo_reply(icmp_socket, payload, dst_addrinfo))
+      while (i != receive_echo_reply(icmp_socket, payload, dst_addrinfo, out))
         ;
       clock_gettime(CLOCK_MONOTONIC, &end);
       long ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
-      printf("Received reply in %ld ms for icmp_seq: %zu\n", ms, i);
+      ping_report_reply(out, i, ms);
       if (i == USHRT_MAX - 1)
         i = 0;
     }
@@ -221,7 +517,21 @@ static int send_icmp_echo_request(int icmp_socket, uCharArray *payload, struct a
   return 0;
 }
 
-static int receive_echo_reply(int icmp_socket, uCharArray *payload, struct addrinfo *dst_addrinfo)
+static void ping_wait_reply(int icmp_socket, pOutput out)
+{
+  struct pollfd poll_fd = {.fd = icmp_socket, .events = POLLIN};
+  long long flush_ns;
+
+  while ((flush_ns = output_flush_due_ns(out)) != -1)
+  {
+    if (flush_ns == 0)
+      output_flush(out);
+    else if (poll(&poll_fd, 1, (flush_ns + 999999) / 1000000) != 0)
+      return;
+  }
+}
+
+static int receive_echo_reply(int icmp_socket, uCharArray *payload, struct addrinfo *dst_addrinfo, pOutput out)
 {
   unsigned char *data = NULL;
   size_t expected_packet_size = 0, padded_payload_size = 0;
@@ -249,6 +559,7 @@ static int receive_echo_reply(int icmp_socket, uCharArray *payload, struct addri
   // Sequence Number "icmp_sequence" in theory can come out of order, so it will be returned to caller to decide what to do
   while (1)
   {
+    ping_wait_reply(icmp_socket, out);
     bytes_read = recvfrom(icmp_socket, data, expected_packet_size, 0, &recv_addr, &recv_addr_len);
     if (bytes_read == -1)
     {
@@ -271,13 +582,443 @@ static int receive_echo_reply(int icmp_socket, uCharArray *payload, struct addri
 
     size_t headers_size = recv_ipv4_hdr_size + sizeof(icmp_hdr);
     if (payload && ((bytes_read - headers_size) != padded_payload_size || memcmp(data + headers_size, payload->array, payload->count)))
-      printf("Waring received ICMP echo reply with Sequence Number %d has invalid data payload.\n", ntohs(icmp_hdr.un.echo.sequence));
+      warning("received ICMP echo reply with Sequence Number %d has invalid data payload.\n", ntohs(icmp_hdr.un.echo.sequence));
     free(data);
     return ntohs(icmp_hdr.un.echo.sequence);
   }
   return -1;
 }
 
+static long long ping_now_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static int ping_parse_range(const char *target, pPingRange range)
+{
+  char first[INET_ADDRSTRLEN], *end;
+  const char *separator;
+  struct in_addr addr;
+  size_t length;
+  long prefix;
+
+  separator = strpbrk(target, "/-");
+  length = separator ? (size_t)(separator - target) : strlen(target);
+  if (length >= sizeof(first))
+    return 1;
+  memcpy(first, target, length);
+  first[length] = '\0';
+  if (inet_pton(AF_INET, first, &addr) != 1)
+    return 1;
+  range->first = range->last = ntohl(addr.s_addr);
+
+  if (separator && *separator == '/')
+  {
+    prefix = strtol(separator + 1, &end, 10);
+    if (end == separator + 1 || *end || prefix < 0 || prefix > 32)
+      return 1;
+    // Host bits of given address are ignored
+    range->first &= prefix ? ~(uint32_t)0 << (32 - prefix) : 0;
+    range->last = range->first | (prefix ? ~(~(uint32_t)0 << (32 - prefix)) : ~(uint32_t)0);
+  }
+  else if (separator)
+  {
+    if (inet_pton(AF_INET, separator + 1, &addr) != 1 || ntohl(addr.s_addr) < range->first)
+      return 1;
+    range->last = ntohl(addr.s_addr);
+  }
+  return 0;
+}
+
+static int ping_compare_ranges(const void *a, const void *b)
+{
+  uint32_t first_a = ((const PingRange *)a)->first, first_b = ((const PingRange *)b)->first;
+  return first_a < first_b ? -1 : first_a > first_b;
+}
+
+static void ping_sweep_init(pPingSweep sweep)
+{
+  size_t merged = 0, bits = 0;
+  long long seed;
+
+  // Overlapping ranges are merged, so every address is probed once
+  qsort(sweep->ranges.array, sweep->ranges.count, sizeof(PingRange), ping_compare_ranges);
+  for (size_t i = 1; i < sweep->ranges.count; ++i)
+  {
+    pPingRange last = &sweep->ranges.array[merged];
+    if (last->last == UINT32_MAX || sweep->ranges.array[i].first <= last->last + 1)
+    {
+      if (sweep->ranges.array[i].last > last->last)
+        last->last = sweep->ranges.array[i].last;
+    }
+    else
+      sweep->ranges.array[++merged] = sweep->ranges.array[i];
+  }
+  sweep->ranges.count = merged + 1;
+
+  sweep->total = 0;
+  for (size_t i = 0; i < sweep->ranges.count; ++i)
+  {
+    sweep->ranges.array[i].offset = sweep->total;
+    sweep->total += (size_t)(sweep->ranges.array[i].last - sweep->ranges.array[i].first) + 1;
+  }
+
+  while (((size_t)1 << bits) < sweep->total)
+    bits++;
+  sweep->half_bits = bits ? (bits + 1) / 2 : 1;
+  seed = ping_now_ns() ^ ((long long)getpid() << 32);
+  for (size_t i = 0; i < PING_SWEEP_ROUNDS; ++i)
+  {
+    // splitmix64 step
+    uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    sweep->keys[i] = z ^ (z >> 31);
+  }
+
+  sweep->replied = calloc(sweep->total / 8 + 1, 1);
+  if (!sweep->replied)
+    report_error_and_exit("cannot allocate memory for reply bitmap\n");
+}
+
+static size_t ping_sweep_permute(pPingSweep sweep, size_t index)
+{
+  uint32_t mask = ((uint64_t)1 << sweep->half_bits) - 1;
+  uint32_t left = (index >> sweep->half_bits) & mask, right = index & mask, mixed;
+
+  // Balanced Feistel network is a bijection on 2 * half_bits wide values
+  for (size_t i = 0; i < PING_SWEEP_ROUNDS; ++i)
+  {
+    mixed = (right ^ sweep->keys[i]) * 0x9E3779B1u;
+    mixed ^= mixed >> 15;
+    mixed *= 0x85EBCA77u;
+    mixed ^= mixed >> 13;
+    mixed = left ^ (mixed & mask);
+    left = right;
+    right = mixed;
+  }
+  return ((size_t)left << sweep->half_bits) | right;
+}
+
+static int ping_sweep_next(pPingShard shard, uint32_t *address, size_t *index)
+{
+  pPingSweep sweep = shard->sweep;
+  size_t low = 0, high = sweep->ranges.count, middle, limit = (size_t)1 << (2 * sweep->half_bits);
+
+  // Cycle walking, at most 3 of 4 permuted values fall out of range
+  do
+  {
+    if (shard->next >= limit)
+      return 0;
+    *index = ping_sweep_permute(sweep, shard->next);
+    shard->next += sweep->shards_count;
+  } while (*index >= sweep->total);
+
+  while (high - low > 1)
+  {
+    middle = (low + high) / 2;
+    if (sweep->ranges.array[middle].offset <= *index)
+      low = middle;
+    else
+      high = middle;
+  }
+  *address = sweep->ranges.array[low].first + (uint32_t)(*index - sweep->ranges.array[low].offset);
+  return 1;
+}
+
+static long long ping_sweep_index(pPingSweep sweep, uint32_t address)
+{
+  size_t low = 0, high = sweep->ranges.count, middle;
+
+  while (low < high)
+  {
+    middle = (low + high) / 2;
+    if (address < sweep->ranges.array[middle].first)
+      high = middle;
+    else if (address > sweep->ranges.array[middle].last)
+      low = middle + 1;
+    else
+      return sweep->ranges.array[middle].offset + (address - sweep->ranges.array[middle].first);
+  }
+  return -1;
+}
+
+static int ping_sweep_send(int icmp_socket, uint32_t address, unsigned short id, unsigned short sequence)
+{
+  unsigned char packet[sizeof(struct icmphdr) + sizeof(long long)];
+  struct icmphdr icmp_header = {0};
+  struct sockaddr_in dst = {0};
+  long long sent_ns = ping_now_ns();
+
+  icmp_header.type = ICMP_ECHO;
+  icmp_header.un.echo.id = htons(id);
+  icmp_header.un.echo.sequence = htons(sequence);
+  memcpy(packet, &icmp_header, sizeof(icmp_header));
+  memcpy(packet + sizeof(icmp_header), &sent_ns, sizeof(sent_ns)); // Echoed back unchanged
+  icmp_header.checksum = csum((unsigned short *)packet, sizeof(packet) / 2);
+  memcpy(packet, &icmp_header, sizeof(icmp_header));
+
+  dst.sin_family = AF_INET;
+  dst.sin_addr.s_addr = htonl(address);
+  return sendto(icmp_socket, packet, sizeof(packet), 0, (struct sockaddr *)&dst, sizeof(dst)) == -1 ? -1 : 0;
+}
+
+static void ping_sweep_receive(pPingShard shard)
+{
+  unsigned char data[IPV4_HEADER_MAX_SIZE + sizeof(struct icmphdr) + sizeof(long long)];
+  pPingSweep sweep = shard->sweep;
+  pPingStats stats = &shard->stats;
+  char addr_str[INET_ADDRSTRLEN];
+  struct sockaddr_in recv_addr;
+  socklen_t recv_addr_len;
+  struct icmphdr icmp_hdr;
+  unsigned char recv_ipv4_hdr_size, bit;
+  long long index, sent_ns, now;
+  unsigned long long latency_us;
+  ssize_t bytes_read;
+
+  while (1)
+  {
+    recv_addr_len = sizeof(recv_addr);
+    bytes_read = recvfrom(shard->icmp_socket, data, sizeof(data), MSG_DONTWAIT, (struct sockaddr *)&recv_addr, &recv_addr_len);
+    if (bytes_read == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("Failed to receive data");
+      return;
+    }
+    recv_ipv4_hdr_size = (*data & 0x0f) * 4;
+    if (recv_ipv4_hdr_size + sizeof(icmp_hdr) + sizeof(sent_ns) > (size_t)bytes_read)
+      continue;
+    memcpy(&icmp_hdr, data + recv_ipv4_hdr_size, sizeof(icmp_hdr));
+    // Checked again in case socket filter could not be attached
+    if (icmp_hdr.type != ICMP_ECHOREPLY || ntohs(icmp_hdr.un.echo.id) != shard->id)
+      continue;
+    index = ping_sweep_index(sweep, ntohl(recv_addr.sin_addr.s_addr));
+    memcpy(&sent_ns, data + recv_ipv4_hdr_size + sizeof(icmp_hdr), sizeof(sent_ns));
+    now = ping_now_ns();
+    if (index == -1 || ntohs(icmp_hdr.un.echo.sequence) != (index & 0xffff) || sent_ns < stats->first_sent_ns || sent_ns > now)
+    {
+      stats->mismatched++;
+      continue;
+    }
+    bit = 1 << (index % 8);
+    if (__atomic_fetch_or(&sweep->replied[index / 8], bit, __ATOMIC_RELAXED) & bit)
+    {
+      stats->duplicates++; // Duplicate reply is reported once
+      continue;
+    }
+    stats->alive++;
+
+    latency_us = (now - sent_ns) / 1000;
+    stats->latencies[ping_latency_bucket(latency_us)]++;
+    if (latency_us > stats->max_latency_us)
+      stats->max_latency_us = latency_us;
+    stats->last_reply_ns = now;
+    if (sweep->benchmark)
+      continue;
+    inet_ntop(AF_INET, &recv_addr.sin_addr, addr_str, sizeof(addr_str));
+    ping_report_alive(shard->out, addr_str, latency_us);
+  }
+}
+
+static int ping_sweep_socket(unsigned short id)
+{
+  int icmp_socket, receive_buffer = PING_SWEEP_RECEIVE_BUFFER;
+  struct sock_filter code[] = {
+      BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0), // IPv4 header length
+      BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0),  // ICMP type
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHOREPLY, 0, 3),
+      BPF_STMT(BPF_LD | BPF_H | BPF_IND, 4), // Echo id
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, id, 0, 1),
+      BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+      BPF_STMT(BPF_RET | BPF_K, 0),
+  };
+  struct sock_fprog filter = {.len = sizeof(code) / sizeof(code[0]), .filter = code};
+
+  icmp_socket = socket(AF_INET, SOCK_RAW, ICMP_PROTO_NUMBER);
+  if (icmp_socket == -1)
+  {
+    perror("Cannot create raw ICMP socket");
+    exit(1);
+  }
+  // Every raw socket gets a copy of every ICMP packet, filter keeps only replies of own shard
+  if (setsockopt(icmp_socket, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)) == -1)
+    warning("cannot attach socket filter, replies are filtered in user space\n");
+  // Replies of a fast sweep come in bursts
+  setsockopt(icmp_socket, SOL_SOCKET, SO_RCVBUF, &receive_buffer, sizeof(receive_buffer));
+  return icmp_socket;
+}
+
+static void *ping_sweep_worker(void *arg)
+{
+  pPingShard shard = arg;
+  pPingSweep sweep = shard->sweep;
+  // Token bucket holds at most 10 ms worth of requests
+  double tokens = 1, burst = sweep->rate / 100 > 1 ? sweep->rate / 100 : 1;
+  long long now, last_refill, deadline = 0, wait_ns, flush_ns;
+  struct pollfd poll_fd = {.fd = shard->icmp_socket, .events = POLLIN};
+  struct timespec wait;
+  unsigned char generated = 1;
+  cpu_set_t cpu;
+  uint32_t address;
+  size_t index;
+
+  if (shard->cpu != -1)
+  {
+    CPU_ZERO(&cpu);
+    CPU_SET(shard->cpu, &cpu);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu), &cpu);
+  }
+
+  shard->stats.first_sent_ns = last_refill = ping_now_ns();
+  while (1)
+  {
+    now = ping_now_ns();
+    tokens += (now - last_refill) * sweep->rate / 1e9;
+    if (tokens > burst)
+      tokens = burst;
+    last_refill = now;
+
+    while (generated && tokens >= 1)
+    {
+      if (!(generated = ping_sweep_next(shard, &address, &index)))
+      {
+        deadline = now + sweep->timeout_ms * 1000000LL;
+        break;
+      }
+      if (ping_sweep_send(shard->icmp_socket, address, shard->id, index & 0xffff) == 0)
+        shard->stats.sent++;
+      else if (errno != EHOSTUNREACH && errno != ENETUNREACH)
+        perror("Error sending ICMP");
+      tokens--;
+    }
+
+    // Shard is done when every request it sent was answered, benchmark waits
+    // for the whole timeout to count duplicate and late replies
+    if (generated)
+      wait_ns = (1 - tokens) * 1e9 / sweep->rate;
+    else if (now >= deadline || (!sweep->benchmark && shard->stats.alive >= shard->stats.sent))
+      break;
+    else
+      wait_ns = deadline - now;
+    // Replies are printed on time even when no later reply ends a record
+    flush_ns = output_flush_due_ns(shard->out);
+    if (flush_ns == 0)
+      output_flush(shard->out);
+    else if (flush_ns > 0 && flush_ns < wait_ns)
+      wait_ns = flush_ns;
+    wait.tv_sec = wait_ns / 1000000000LL;
+    wait.tv_nsec = wait_ns % 1000000000LL;
+    if (ppoll(&poll_fd, 1, &wait, NULL) > 0)
+      ping_sweep_receive(shard);
+  }
+  output_flush(shard->out);
+  return NULL;
+}
+
+static void ping_merge_stats(pPingStats total, pPingStats stats)
+{
+  if (!total->first_sent_ns || (stats->first_sent_ns && stats->first_sent_ns < total->first_sent_ns))
+    total->first_sent_ns = stats->first_sent_ns;
+  if (stats->last_reply_ns > total->last_reply_ns)
+    total->last_reply_ns = stats->last_reply_ns;
+  if (stats->max_latency_us > total->max_latency_us)
+    total->max_latency_us = stats->max_latency_us;
+  total->sent += stats->sent;
+  total->alive += stats->alive;
+  total->duplicates += stats->duplicates;
+  total->mismatched += stats->mismatched;
+  for (size_t i = 0; i < PING_LATENCY_BUCKETS; ++i)
+    total->latencies[i] += stats->latencies[i];
+}
+
+static void ping_report_benchmark(pOutput out, pPingStats stats)
+{
+  long long duration_us = stats->last_reply_ns > stats->first_sent_ns ? (stats->last_reply_ns - stats->first_sent_ns) / 1000 : 0;
+  unsigned long long throughput = duration_us ? stats->alive * 1000000ULL / duration_us : 0;
+  const char *names[] = {"p50_us", "p90_us", "p99_us", "p999_us"}, *plain_names[] = {"p50", "p90", "p99", "p99.9"};
+  const double fractions[] = {0.5, 0.9, 0.99, 0.999};
+
+  if (out->format == OUTPUT_PLAIN)
+  {
+    output_str(out, "Benchmark: ");
+    output_uint(out, stats->alive);
+    output_str(out, " replies in ");
+    output_uint(out, duration_us / 1000);
+    output_str(out, " ms, ");
+    output_uint(out, throughput);
+    output_str(out, " replies/s, lost ");
+    output_uint(out, stats->sent - stats->alive);
+    output_str(out, ", duplicates ");
+    output_uint(out, stats->duplicates);
+    output_str(out, ", mismatched ");
+    output_uint(out, stats->mismatched);
+    output_end_record(out);
+    output_str(out, "Latency us:");
+    for (size_t i = 0; i < sizeof(fractions) / sizeof(fractions[0]); ++i)
+    {
+      output_str(out, " ");
+      output_str(out, plain_names[i]);
+      output_str(out, "=");
+      output_uint(out, ping_latency_percentile(stats, fractions[i]));
+    }
+    output_str(out, " max=");
+    output_uint(out, stats->max_latency_us);
+  }
+  else
+  {
+    output_field_str(out, "event", "benchmark");
+    output_field_uint(out, "replies", stats->alive);
+    output_field_uint(out, "duration_us", duration_us);
+    output_field_uint(out, "replies_per_second", throughput);
+    output_field_uint(out, "lost", stats->sent - stats->alive);
+    output_field_uint(out, "duplicates", stats->duplicates);
+    output_field_uint(out, "mismatched", stats->mismatched);
+    for (size_t i = 0; i < sizeof(fractions) / sizeof(fractions[0]); ++i)
+      output_field_uint(out, names[i], ping_latency_percentile(stats, fractions[i]));
+    output_field_uint(out, "max_us", stats->max_latency_us);
+  }
+  output_end_record(out);
+}
+
+static size_t ping_latency_bucket(unsigned long long us)
+{
+  unsigned int msb;
+
+  if (us < (1 << PING_LATENCY_SUB_BITS))
+    return us;
+  msb = 63 - __builtin_clzll(us);
+  return ((msb - PING_LATENCY_SUB_BITS + 1) << PING_LATENCY_SUB_BITS) +
+         ((us >> (msb - PING_LATENCY_SUB_BITS)) & ((1 << PING_LATENCY_SUB_BITS) - 1));
+}
+
+static unsigned long long ping_latency_bucket_high(size_t bucket)
+{
+  unsigned int shift;
+
+  if (bucket < (1 << PING_LATENCY_SUB_BITS))
+    return bucket;
+  shift = (bucket >> PING_LATENCY_SUB_BITS) - 1;
+  return (((1ULL << PING_LATENCY_SUB_BITS) + (bucket & ((1 << PING_LATENCY_SUB_BITS) - 1))) << shift) + ((1ULL << shift) - 1);
+}
+
+static unsigned long long ping_latency_percentile(pPingStats stats, double fraction)
+{
+  size_t seen = 0, rank = fraction * stats->alive;
+
+  if (rank < fraction * stats->alive)
+    rank++;
+  for (size_t i = 0; i < PING_LATENCY_BUCKETS && stats->alive; ++i)
+    if ((seen += stats->latencies[i]) >= rank && seen)
+      return ping_latency_bucket_high(i) < stats->max_latency_us ? ping_latency_bucket_high(i) : stats->max_latency_us;
+  return 0;
+}
+
 #elif _WIN32
 #else
 
@@ -0,0 +1,13 @@
+#define _GNU_SOURCE
+#include "string.h"
+#define INTERNAL_UTILS_IMPLEMENTATION
+#define ARGPARSE_HEADER_IMPLEMENTATION
+#define OUTPUT_HEADER_IMPLEMENTATION
+#define RESPONDER_HEADER_IMPLEMENTATION
+#include "responder.h"
+
+// Test tool, kept out of multi-call main
+int main(int argc, char **argv)
+{
+    return responder_main(argc, argv);
+}
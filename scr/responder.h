@@ -0,0 +1,528 @@
+// Notes:
+// TUN/TAP:  https://docs.kernel.org/networking/tuntap.html
+// IP RFC:   https://datatracker.ietf.org/doc/html/rfc791
+// ICMP RFC: https://datatracker.ietf.org/doc/html/rfc792
+//
+// Stand-in ICMP echo responder for load testing ping without external network.
+// Creates TUN device routed to a subnet, every address of the subnet except the device own one
+// is answered by this process with configured delay, loss, duplication and reordering.
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "internal_utils.h"
+#include "dynamic_array.h"
+#include "argparse.h"
+#include "output.h"
+
+#ifndef RESPONDER_HEADER
+#define RESPONDER_HEADER
+#if __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/icmp.h>
+#include <linux/if_tun.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#endif // __linux__
+
+#define RESPONDER_MTU 1500
+// Packets read from device before due replies are written again
+#define RESPONDER_READ_BATCH 64
+
+#define RESPONDER_FIXED 0
+#define RESPONDER_UNIFORM 1     // Uniform in [0, 2 * mean]
+#define RESPONDER_EXPONENTIAL 2 // Exponential with given mean
+#define RESPONDER_PARETO 3      // Pareto with shape 1.5 and given mean, heavy tail
+
+// Reply waiting for its due time
+struct
+{
+    long long due_ns;
+    size_t size;
+    unsigned char *packet;
+} typedef ResponderReply, *pResponderReply;
+
+struct
+{
+    int tun_fd;
+    int distribution; // RESPONDER_*
+    double delay_ms;  // Mean delay
+    double loss;      // Probabilities
+    double duplicate;
+    double reorder;
+    double reorder_ms; // Extra delay of reordered replies, later replies overtake them
+    uint64_t random;
+    struct
+    {
+        size_t count;
+        size_t capacity;
+        pResponderReply array;
+    } queue; // Min heap by due time
+    size_t requests;
+    size_t replies;
+    size_t dropped;
+    size_t duplicated;
+    size_t reordered;
+    size_t ignored; // Not echo requests
+} typedef Responder, *pResponder;
+
+int responder_main(int argc, char **argv);
+static void responder_implementation(pArglist arg_list);
+// Returns RESPONDER_* for distribution name or -1 if not known
+static int responder_parse_distribution(const char *name);
+static double responder_parse_probability(pArglist arg_list, char *key);
+#if __linux__
+// Creates TUN device with address/prefix, returns its fd
+static int responder_open_tun(char *name, const char *cidr);
+static void responder_run(pResponder responder, long long duration_ns);
+// Answers echo request, queues reply or drops it
+static void responder_on_packet(pResponder responder, unsigned char *packet, size_t size, long long now);
+// Writes replies due before now
+static void responder_flush(pResponder responder, long long now);
+static void responder_push(pResponder responder, ResponderReply reply);
+static ResponderReply responder_pop(pResponder responder);
+static double responder_delay_ms(pResponder responder);
+// Uniform in (0, 1], xorshift64*
+static double responder_random(pResponder responder);
+static unsigned short responder_checksum(const unsigned char *buff, size_t size);
+static long long responder_now_ns(void);
+static void responder_on_signal(int signal);
+#endif // __linux__
+static void responder_report(pResponder responder, pOutput out);
+
+// #define RESPONDER_HEADER_IMPLEMENTATION
+#ifdef RESPONDER_HEADER_IMPLEMENTATION
+
+#if __linux__
+static volatile sig_atomic_t responder_stop;
+#endif // __linux__
+
+int responder_main(int argc, char **argv)
+{
+    Arglist arg_list = {.footer_msg = "Answers ICMP echo requests sent to a subnet routed to TUN device, for load testing ping.\n"
+                                      "Usage: responder [OPTION(s)]\nRuns until interrupted or -t seconds passed, then prints statistics."};
+
+    push_argument(&arg_list, (Argument){.key = "-h", .flag = IS_FLAG, .help_msg = "Prints this help message."});
+    push_argument(&arg_list, (Argument){.key = "-i", .flag = DEFAULT_VALUE, .help_msg = "Name of TUN device.", .value = "myutils0"});
+    push_argument(&arg_list, (Argument){.key = "-a", .flag = DEFAULT_VALUE, .help_msg = "Device address and prefix, rest of the subnet is answered.", .value = "10.99.0.1/16"});
+    push_argument(&arg_list, (Argument){.key = "-d", .flag = DEFAULT_VALUE, .help_msg = "Mean reply delay in ms.", .value = "0"});
+    push_argument(&arg_list, (Argument){.key = "-D", .flag = DEFAULT_VALUE, .help_msg = "Delay distribution: fixed, uniform, exp or pareto.", .value = "fixed"});
+    push_argument(&arg_list, (Argument){.key = "-l", .flag = DEFAULT_VALUE, .help_msg = "Probability of dropping request.", .value = "0"});
+    push_argument(&arg_list, (Argument){.key = "-u", .flag = DEFAULT_VALUE, .help_msg = "Probability of sending reply twice.", .value = "0"});
+    push_argument(&arg_list, (Argument){.key = "-o", .flag = DEFAULT_VALUE, .help_msg = "Probability of holding reply back, so it is reordered.", .value = "0"});
+    push_argument(&arg_list, (Argument){.key = "-O", .flag = DEFAULT_VALUE, .help_msg = "Extra delay in ms of reordered replies.", .value = "10"});
+    push_argument(&arg_list, (Argument){.key = "-s", .flag = ARG_OPTIONAL, .help_msg = "Random seed, for repeatable runs."});
+    push_argument(&arg_list, (Argument){.key = "-t", .flag = ARG_OPTIONAL, .help_msg = "Seconds to run."});
+    push_argument(&arg_list, (Argument){.key = "-F", .flag = DEFAULT_VALUE, .help_msg = "Output format: plain, tsv or json.", .value = "plain"});
+    parse_arguments(argc, argv, &arg_list);
+
+    if (is_flag_set(&arg_list, "-h"))
+    {
+        print_default_help(&arg_list);
+        exit(0);
+    }
+    else
+    {
+        responder_implementation(&arg_list);
+    }
+
+    free_array(arg_list);
+    return 0;
+}
+
+static int responder_parse_distribution(const char *name)
+{
+    if (!strcmp(name, "fixed"))
+        return RESPONDER_FIXED;
+    if (!strcmp(name, "uniform"))
+        return RESPONDER_UNIFORM;
+    if (!strcmp(name, "exp"))
+        return RESPONDER_EXPONENTIAL;
+    if (!strcmp(name, "pareto"))
+        return RESPONDER_PARETO;
+    return -1;
+}
+
+static double responder_parse_probability(pArglist arg_list, char *key)
+{
+    char *end, *value = get_value_by_key(arg_list, key);
+    double probability = strtod(value, &end);
+
+    if (end == value || *end || probability < 0 || probability > 1)
+        report_error_and_exit("wrong value specified for %s '%s'\n", key, value);
+    return probability;
+}
+
+static void responder_report(pResponder responder, pOutput out)
+{
+    if (out->format == OUTPUT_PLAIN)
+    {
+        output_str(out, "Received ");
+        output_uint(out, responder->requests);
+        output_str(out, " echo requests, sent ");
+        output_uint(out, responder->replies);
+        output_str(out, " replies, dropped ");
+        output_uint(out, responder->dropped);
+        output_str(out, ", duplicated ");
+        output_uint(out, responder->duplicated);
+        output_str(out, ", reordered ");
+        output_uint(out, responder->reordered);
+        output_str(out, ", ignored ");
+        output_uint(out, responder->ignored);
+        output_str(out, " other packets");
+    }
+    else
+    {
+        output_field_str(out, "event", "responder");
+        output_field_uint(out, "requests", responder->requests);
+        output_field_uint(out, "replies", responder->replies);
+        output_field_uint(out, "dropped", responder->dropped);
+        output_field_uint(out, "duplicated", responder->duplicated);
+        output_field_uint(out, "reordered", responder->reordered);
+        output_field_uint(out, "ignored", responder->ignored);
+    }
+    output_end_record(out);
+}
+
+#if __linux__
+
+static void responder_implementation(pArglist arg_list)
+{
+    static Output out;
+    Responder responder = {0};
+    struct sigaction action = {0};
+    long long duration_ns = 0;
+    char *end;
+    int format;
+
+    if ((format = output_parse_format(get_value_by_key(arg_list, "-F"))) == -1)
+        report_error_and_exit("wrong value specified for -F '%s'\n", get_value_by_key(arg_list, "-F"));
+    output_init(&out, STDOUT_FILENO, format, NULL, 0);
+
+    if ((responder.distribution = responder_parse_distribution(get_value_by_key(arg_list, "-D"))) == -1)
+        report_error_and_exit("wrong value specified for -D '%s'\n", get_value_by_key(arg_list, "-D"));
+    responder.delay_ms = strtod(get_value_by_key(arg_list, "-d"), &end);
+    if (*end || responder.delay_ms < 0)
+        report_error_and_exit("wrong value specified for -d '%s'\n", get_value_by_key(arg_list, "-d"));
+    responder.reorder_ms = strtod(get_value_by_key(arg_list, "-O"), &end);
+    if (*end || responder.reorder_ms < 0)
+        report_error_and_exit("wrong value specified for -O '%s'\n", get_value_by_key(arg_list, "-O"));
+    responder.loss = responder_parse_probability(arg_list, "-l");
+    responder.duplicate = responder_parse_probability(arg_list, "-u");
+    responder.reorder = responder_parse_probability(arg_list, "-o");
+    if (is_value_set(arg_list, "-t") && (duration_ns = strtod(get_value_by_key(arg_list, "-t"), NULL) * 1e9) <= 0)
+        report_error_and_exit("wrong value specified for -t '%s'\n", get_value_by_key(arg_list, "-t"));
+    responder.random = is_value_set(arg_list, "-s") ? strtoull(get_value_by_key(arg_list, "-s"), NULL, 10) : (uint64_t)responder_now_ns() ^ getpid();
+    if (!responder.random)
+        responder.random = 1; // Zero is a fixed point of xorshift
+
+    action.sa_handler = responder_on_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    responder.tun_fd = responder_open_tun(get_value_by_key(arg_list, "-i"), get_value_by_key(arg_list, "-a"));
+    responder_run(&responder, duration_ns);
+    responder_report(&responder, &out);
+    output_flush(&out);
+
+    close(responder.tun_fd);
+    while (responder.queue.count)
+        free(responder_pop(&responder).packet);
+    free_array(responder.queue);
+}
+
+static int responder_open_tun(char *name, const char *cidr)
+{
+    struct sockaddr_in *addr;
+    struct ifreq ifr = {0};
+    struct in_addr address;
+    char host[INET_ADDRSTRLEN], *end;
+    const char *slash = strchr(cidr, '/');
+    long prefix;
+    int fd, sock;
+
+    if (!slash || (size_t)(slash - cidr) >= sizeof(host))
+        report_error_and_exit("wrong value specified for -a '%s'\n", cidr);
+    memcpy(host, cidr, slash - cidr);
+    host[slash - cidr] = '\0';
+    prefix = strtol(slash + 1, &end, 10);
+    // At least one address besides device own is needed
+    if (inet_pton(AF_INET, host, &address) != 1 || *end || prefix < 1 || prefix > 30)
+        report_error_and_exit("wrong value specified for -a '%s'\n", cidr);
+
+    if ((fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC)) == -1)
+    {
+        perror("Cannot open /dev/net/tun");
+        exit(1);
+    }
+    ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+    strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+    if (ioctl(fd, TUNSETIFF, &ifr) == -1)
+    {
+        perror("Cannot create TUN device");
+        exit(1);
+    }
+
+    // Address and route of the subnet are set up by kernel when device goes up
+    if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
+    {
+        perror("Cannot create socket for device setup");
+        exit(1);
+    }
+    addr = (struct sockaddr_in *)&ifr.ifr_addr;
+    addr->sin_family = AF_INET;
+    addr->sin_addr = address;
+    if (ioctl(sock, SIOCSIFADDR, &ifr) == -1)
+    {
+        perror("Cannot set device address");
+        exit(1);
+    }
+    addr->sin_addr.s_addr = htonl(~(uint32_t)0 << (32 - prefix));
+    if (ioctl(sock, SIOCSIFNETMASK, &ifr) == -1)
+    {
+        perror("Cannot set device netmask");
+        exit(1);
+    }
+    if (ioctl(sock, SIOCGIFFLAGS, &ifr) == -1)
+    {
+        perror("Cannot get device flags");
+        exit(1);
+    }
+    ifr.ifr_flags |= IFF_UP | IFF_RUNNING;
+    if (ioctl(sock, SIOCSIFFLAGS, &ifr) == -1)
+    {
+        perror("Cannot bring device up");
+        exit(1);
+    }
+    close(sock);
+    return fd;
+}
+
+static void responder_run(pResponder responder, long long duration_ns)
+{
+    unsigned char packet[RESPONDER_MTU];
+    long long now, wait_ns, end_ns = 0;
+    struct pollfd poll_fd = {.fd = responder->tun_fd, .events = POLLIN};
+    struct timespec wait;
+    ssize_t bytes_read;
+
+    if (duration_ns)
+        end_ns = responder_now_ns() + duration_ns;
+    while (!responder_stop)
+    {
+        now = responder_now_ns();
+        if (end_ns && now >= end_ns)
+            break;
+        responder_flush(responder, now);
+
+        wait_ns = responder->queue.count ? responder->queue.array[0].due_ns - now : 100000000LL;
+        if (end_ns && end_ns - now < wait_ns)
+            wait_ns = end_ns - now;
+        wait.tv_sec = wait_ns / 1000000000LL;
+        wait.tv_nsec = wait_ns % 1000000000LL;
+        if (ppoll(&poll_fd, 1, &wait, NULL) <= 0)
+            continue;
+
+        now = responder_now_ns();
+        for (size_t i = 0; i < RESPONDER_READ_BATCH; ++i)
+        {
+            bytes_read = read(responder->tun_fd, packet, sizeof(packet));
+            if (bytes_read == -1)
+            {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    perror("Failed to read from TUN device");
+                break;
+            }
+            responder_on_packet(responder, packet, bytes_read, now);
+        }
+    }
+}
+
+static void responder_on_packet(pResponder responder, unsigned char *packet, size_t size, long long now)
+{
+    ResponderReply reply;
+    size_t header_size, total_size, copies;
+    unsigned short checksum;
+    unsigned char address[4];
+
+    header_size = (packet[0] & 0x0f) * 4;
+    total_size = size >= 4 ? (packet[2] << 8 | packet[3]) : 0;
+    // IPv4, ICMP protocol, echo request
+    if (size < 20 || (packet[0] >> 4) != 4 || header_size < 20 || total_size > size || header_size + sizeof(struct icmphdr) > total_size ||
+        packet[9] != 1 || packet[header_size] != ICMP_ECHO)
+    {
+        responder->ignored++;
+        return;
+    }
+    responder->requests++;
+    if (responder_random(responder) <= responder->loss)
+    {
+        responder->dropped++;
+        return;
+    }
+    copies = 1;
+    if (responder_random(responder) <= responder->duplicate)
+    {
+        responder->duplicated++;
+        copies++;
+    }
+
+    // Addresses are swapped, TTL is reset, payload is echoed unchanged
+    memcpy(address, packet + 12, 4);
+    memcpy(packet + 12, packet + 16, 4);
+    memcpy(packet + 16, address, 4);
+    packet[8] = 64;
+    packet[10] = packet[11] = 0;
+    checksum = responder_checksum(packet, header_size);
+    memcpy(packet + 10, &checksum, 2);
+    packet[header_size] = ICMP_ECHOREPLY;
+    packet[header_size + 2] = packet[header_size + 3] = 0;
+    checksum = responder_checksum(packet + header_size, total_size - header_size);
+    memcpy(packet + header_size + 2, &checksum, 2);
+
+    for (size_t i = 0; i < copies; ++i)
+    {
+        reply.size = total_size;
+        reply.due_ns = now + responder_delay_ms(responder) * 1e6;
+        if (responder_random(responder) <= responder->reorder)
+        {
+            responder->reordered++;
+            reply.due_ns += responder->reorder_ms * 1e6;
+        }
+        if (!(reply.packet = malloc(total_size)))
+            report_error_and_exit("cannot allocate memory for reply\n");
+        memcpy(reply.packet, packet, total_size);
+        responder_push(responder, reply);
+    }
+}
+
+static void responder_flush(pResponder responder, long long now)
+{
+    ResponderReply reply;
+
+    while (responder->queue.count && responder->queue.array[0].due_ns <= now)
+    {
+        reply = responder_pop(responder);
+        if (write(responder->tun_fd, reply.packet, reply.size) == -1)
+            perror("Failed to write to TUN device");
+        else
+            responder->replies++;
+        free(reply.packet);
+    }
+}
+
+static void responder_push(pResponder responder, ResponderReply reply)
+{
+    pResponderReply heap;
+    ResponderReply swap;
+    size_t i, parent;
+
+    append(ResponderReply, responder->queue, reply);
+    heap = responder->queue.array;
+    for (i = responder->queue.count - 1; i && heap[(parent = (i - 1) / 2)].due_ns > heap[i].due_ns; i = parent)
+    {
+        swap = heap[parent];
+        heap[parent] = heap[i];
+        heap[i] = swap;
+    }
+}
+
+static ResponderReply responder_pop(pResponder responder)
+{
+    pResponderReply heap = responder->queue.array;
+    ResponderReply top = heap[0], swap;
+    size_t i = 0, child, count = --responder->queue.count;
+
+    heap[0] = heap[count];
+    while ((child = 2 * i + 1) < count)
+    {
+        if (child + 1 < count && heap[child + 1].due_ns < heap[child].due_ns)
+            child++;
+        if (heap[i].due_ns <= heap[child].due_ns)
+            break;
+        swap = heap[child];
+        heap[child] = heap[i];
+        heap[i] = swap;
+        i = child;
+    }
+    return top;
+}
+
+static double responder_delay_ms(pResponder responder)
+{
+    switch (responder->distribution)
+    {
+    case RESPONDER_UNIFORM:
+        return 2 * responder->delay_ms * responder_random(responder);
+    case RESPONDER_EXPONENTIAL:
+        return -responder->delay_ms * log(responder_random(responder));
+    case RESPONDER_PARETO:
+        // Scale is chosen so that mean is delay_ms
+        return responder->delay_ms / 3 / pow(responder_random(responder), 1 / 1.5);
+    }
+    return responder->delay_ms;
+}
+
+static double responder_random(pResponder responder)
+{
+    responder->random ^= responder->random >> 12;
+    responder->random ^= responder->random << 25;
+    responder->random ^= responder->random >> 27;
+    return ((responder->random * 0x2545F4914F6CDD1DULL >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+static unsigned short responder_checksum(const unsigned char *buff, size_t size)
+{
+    unsigned long sum = 0;
+    unsigned short word;
+
+    for (size_t i = 0; i + 1 < size; i += 2)
+    {
+        memcpy(&word, buff + i, 2);
+        sum += word;
+    }
+    // Odd byte is padded with zero
+    if (size % 2)
+    {
+        word = 0;
+        memcpy(&word, buff + size - 1, 1);
+        sum += word;
+    }
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum += sum >> 16;
+    return (unsigned short)~sum;
+}
+
+static long long responder_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void responder_on_signal(int signal)
+{
+    responder_stop = 1;
+}
+
+#else
+
+static void responder_implementation(pArglist arg_list)
+{
+    report_error_and_exit("Platform not supported");
+}
+
+#endif // __linux__
+
+#endif // RESPONDER_HEADER_IMPLEMENTATION
+
+#endif // RESPONDER_HEADER
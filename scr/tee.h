@@ -1,12 +1,77 @@
 #include "internal_utils.h"
 #include "argparse.h"
 #include "ctype.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#endif // __linux__
 
 #ifndef TEE_HEADER
 #define TEE_HEADER
 
+#define TEE_BUFFER_SIZE (1 << 20)
+// O_DIRECT requires buffer address, file offset and size aligned to logical block size
+#define TEE_DIRECT_ALIGNMENT 4096
+#define TEE_DIRECT_BUFFER_SIZE (1 << 20)
+// Bytes copied to each output in turn when standard input is a regular file
+#define TEE_COPY_CHUNK_SIZE (8 << 20)
+
+// How output is produced from regular file on standard input
+#define TEE_COPY_USER 0     // pread and write
+#define TEE_COPY_RANGE 1    // copy_file_range, can be done by filesystem or storage
+#define TEE_COPY_SENDFILE 2 // sendfile for outputs that are not regular files
+
+// I/O policy requested on command line, applied to every FILE that supports it
+struct
+{
+    size_t preallocate;  // Extent size for fallocate, 0 if disabled
+    size_t write_behind; // Window for sync_file_range write-behind, 0 if disabled
+    unsigned char direct;
+    unsigned char append;
+} typedef TeePolicy, *pTeePolicy;
+
+// Opened output with its own copy of policy, policies not supported by output are dropped
+struct
+{
+    int fd;
+    char *name;
+    TeePolicy policy;
+    off_t position;  // Current file offset
+    off_t allocated; // End of preallocated range
+    off_t flushed;   // End of range submitted for writeback
+    off_t dropped;   // End of range written back and dropped from page cache
+    unsigned char *direct_buff;
+    size_t direct_count;
+    unsigned char copy; // TEE_COPY_* method
+    unsigned char regular;
+} typedef TeeOutput, *pTeeOutput;
+
 int tee_main(int argc, char **argv);
 static int tee_implementation(pArglist arg_list);
+// Returns -1 if file cannot be opened
+static int tee_open_output(char *name, pTeePolicy policy, pTeeOutput output);
+// Writes buffer to output applying its policy, exits if write fails
+static void tee_write_output(pTeeOutput output, const unsigned char *buff, size_t size);
+// Writes buffered O_DIRECT tail, releases unused preallocation and page cache, closes file
+static void tee_close_output(pTeeOutput output);
+// Writes whole buffer handling partial writes, returns -1 on error
+static int tee_write_all(int fd, const unsigned char *buff, size_t size);
+#if __linux__
+static void tee_preallocate(pTeeOutput output, size_t size);
+static void tee_write_behind(pTeeOutput output);
+// Produces outputs from standard input that is regular file, returns number of bytes copied from offset.
+// Outputs are cloned if filesystem supports reflinks, otherwise copied in kernel chunk by chunk.
+static off_t tee_copy_regular_input(pTeeOutput outputs, size_t count, off_t offset, off_t size, unsigned char *buff);
+// Copies count bytes of standard input at offset to output, falls back to pread and write if kernel copy fails
+static void tee_copy_output(pTeeOutput output, off_t offset, size_t count, unsigned char *buff);
+// Returns 0 if output now shares extents of [offset, offset + size) of standard input
+static int tee_clone_output(pTeeOutput output, off_t offset, off_t size);
+#endif // __linux__
 
 #define TEE_HEADER_IMPLEMENTATION
 #ifdef TEE_HEADER_IMPLEMENTATION
@@ -15,9 +80,13 @@ int tee_main(int argc, char **argv)
 {
     Arglist arg_list = {.footer_msg = "tee - read from standard input and write to standard output and files"
                                       "tee [OPTION(s)] [FILE(s)]\nCopy standard input to each FILE, and also to standard output.",
-                        .epilog = "By default files that cannot be opened will be ignored, but if cannot write to one of files execution stops."};
+                        .epilog = "By default files that cannot be opened will be ignored, but if cannot write to one of files execution stops.\n"
+                                  "I/O policies apply to FILE(s) that are regular files, SIZE accepts K, M and G suffixes."};
     push_argument(&arg_list, (Argument){.key = "-h", .flag = IS_FLAG, .help_msg = "Prints this help message."});
     push_argument(&arg_list, (Argument){.key = "-a", .flag = IS_FLAG, .help_msg = "Opens FILE(s) in append mode."});
+    push_argument(&arg_list, (Argument){.key = "-p", .flag = ARG_OPTIONAL, .help_msg = "Preallocate FILE(s) with fallocate in extents of SIZE."});
+    push_argument(&arg_list, (Argument){.key = "-s", .flag = ARG_OPTIONAL, .help_msg = "Write-behind: every SIZE written start writeback and drop written pages from cache."});
+    push_argument(&arg_list, (Argument){.key = "-D", .flag = IS_FLAG, .help_msg = "Write FILE(s) with O_DIRECT, bypassing page cache."});
     parse_arguments(argc, argv, &arg_list);
     if (is_flag_set(&arg_list, "-h"))
     {
@@ -30,52 +99,365 @@ int tee_main(int argc, char **argv)
     return 0;
 }
 
+static int tee_write_all(int fd, const unsigned char *buff, size_t size)
+{
+    ssize_t bytes_wrote;
+
+    while (size)
+    {
+        bytes_wrote = write(fd, buff, size);
+        if (bytes_wrote == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buff += bytes_wrote;
+        size -= bytes_wrote;
+    }
+    return 0;
+}
+
+static int tee_open_output(char *name, pTeePolicy policy, pTeeOutput output)
+{
+    int flags = O_WRONLY | O_CREAT | (policy->append ? O_APPEND : O_TRUNC);
+    struct stat st;
+
+    memset(output, 0, sizeof(*output));
+    output->name = name;
+    output->policy = *policy;
+
+#if __linux__
+    output->fd = open(name, flags | (policy->direct ? O_DIRECT : 0), 0666);
+    if (output->fd == -1 && policy->direct && errno == EINVAL)
+    {
+        warning("O_DIRECT is not supported for file: %s\n", name);
+        output->policy.direct = 0;
+        output->fd = open(name, flags, 0666);
+    }
+#else
+    output->fd = open(name, flags, 0666);
+#endif // __linux__
+    if (output->fd == -1)
+        return -1;
+
+    if (fstat(output->fd, &st) == -1 || !S_ISREG(st.st_mode))
+    {
+        // Devices, pipes and sockets are written as is
+        memset(&output->policy, 0, sizeof(output->policy));
+        return 0;
+    }
+    output->regular = 1;
+
+    output->position = policy->append ? st.st_size : 0;
+    output->allocated = output->flushed = output->dropped = output->position;
+#if __linux__
+    if (output->policy.direct && output->position % TEE_DIRECT_ALIGNMENT)
+    {
+        warning("cannot append with O_DIRECT to file with unaligned size: %s\n", name);
+        output->policy.direct = 0;
+        fcntl(output->fd, F_SETFL, fcntl(output->fd, F_GETFL) & ~O_DIRECT);
+    }
+    if (output->policy.direct)
+    {
+        output->policy.write_behind = 0; // Nothing is left in page cache
+        if (posix_memalign((void **)&output->direct_buff, TEE_DIRECT_ALIGNMENT, TEE_DIRECT_BUFFER_SIZE))
+            report_error_and_exit("cannot allocate O_DIRECT buffer for file: %s\n", name);
+    }
+#endif // __linux__
+    return 0;
+}
+
+#if __linux__
+
+static void tee_preallocate(pTeeOutput output, size_t size)
+{
+    off_t extent = output->policy.preallocate;
+
+    if (output->position + (off_t)size <= output->allocated)
+        return;
+    // Allocate whole extents covering pending write, file size is updated by writes only
+    off_t end = ((output->position + size + extent - 1) / extent) * extent;
+    if (fallocate(output->fd, FALLOC_FL_KEEP_SIZE, output->allocated, end - output->allocated) == -1)
+    {
+        warning("cannot preallocate file %s, preallocation disabled for it\n", output->name);
+        output->policy.preallocate = 0;
+        return;
+    }
+    output->allocated = end;
+}
+
+static void tee_write_behind(pTeeOutput output)
+{
+    if (output->position - output->flushed < (off_t)output->policy.write_behind)
+        return;
+
+    // Start writeback of the last window, wait for previous one and drop it from page cache.
+    // Writer is never blocked on the window it just filled, so throughput stays steady.
+    sync_file_range(output->fd, output->flushed, output->position - output->flushed, SYNC_FILE_RANGE_WRITE);
+    if (output->flushed > output->dropped)
+    {
+        sync_file_range(output->fd, output->dropped, output->flushed - output->dropped,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(output->fd, output->dropped, output->flushed - output->dropped, POSIX_FADV_DONTNEED);
+        output->dropped = output->flushed;
+    }
+    output->flushed = output->position;
+}
+
+#endif // __linux__
+
+static void tee_write_output(pTeeOutput output, const unsigned char *buff, size_t size)
+{
+    size_t chunk;
+
+#if __linux__
+    if (output->policy.preallocate)
+        tee_preallocate(output, size);
+#endif // __linux__
+
+    if (!output->policy.direct)
+    {
+        if (tee_write_all(output->fd, buff, size) == -1)
+            report_error_and_exit("cannot write to specified file: %s\n", output->name);
+        output->position += size;
+#if __linux__
+        if (output->policy.write_behind)
+            tee_write_behind(output);
+#endif // __linux__
+        return;
+    }
+
+    while (size)
+    {
+        chunk = TEE_DIRECT_BUFFER_SIZE - output->direct_count;
+        chunk = chunk < size ? chunk : size;
+        memcpy(output->direct_buff + output->direct_count, buff, chunk);
+        output->direct_count += chunk;
+        buff += chunk;
+        size -= chunk;
+        if (output->direct_count == TEE_DIRECT_BUFFER_SIZE)
+        {
+            if (tee_write_all(output->fd, output->direct_buff, TEE_DIRECT_BUFFER_SIZE) == -1)
+                report_error_and_exit("cannot write to specified file: %s\n", output->name);
+            output->position += TEE_DIRECT_BUFFER_SIZE;
+            output->direct_count = 0;
+        }
+    }
+}
+
+static void tee_close_output(pTeeOutput output)
+{
+#if __linux__
+    size_t aligned;
+
+    if (output->policy.direct && output->direct_count)
+    {
+        aligned = output->direct_count - output->direct_count % TEE_DIRECT_ALIGNMENT;
+        if (tee_write_all(output->fd, output->direct_buff, aligned) == -1)
+            report_error_and_exit("cannot write to specified file: %s\n", output->name);
+        // Unaligned tail is written through page cache
+        fcntl(output->fd, F_SETFL, fcntl(output->fd, F_GETFL) & ~O_DIRECT);
+        if (tee_write_all(output->fd, output->direct_buff + aligned, output->direct_count - aligned) == -1)
+            report_error_and_exit("cannot write to specified file: %s\n", output->name);
+        output->position += output->direct_count;
+        output->direct_count = 0;
+    }
+    if (output->policy.preallocate && output->allocated > output->position)
+        ftruncate(output->fd, output->position); // Frees blocks preallocated past end of file
+    if (output->policy.write_behind && output->position > output->dropped)
+    {
+        sync_file_range(output->fd, output->dropped, 0,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(output->fd, output->dropped, 0, POSIX_FADV_DONTNEED);
+    }
+#endif // __linux__
+    free(output->direct_buff);
+    close(output->fd);
+}
+
+#if __linux__
+
+static int tee_clone_output(pTeeOutput output, off_t offset, off_t size)
+{
+    struct file_clone_range range = {.src_fd = STDIN_FILENO,
+                                     .src_offset = offset,
+                                     .src_length = size,
+                                     .dest_offset = output->position};
+
+    if (output->copy != TEE_COPY_RANGE || output->policy.preallocate)
+        return -1;
+    // Offsets must be block aligned, length too unless range ends at end of file
+    if (ioctl(output->fd, FICLONERANGE, &range) == -1)
+        return -1;
+    output->position += size;
+    return 0;
+}
+
+static void tee_copy_output(pTeeOutput output, off_t offset, size_t count, unsigned char *buff)
+{
+    ssize_t copied;
+
+    if (output->policy.preallocate && output->copy != TEE_COPY_USER)
+        tee_preallocate(output, count);
+
+    while (count)
+    {
+        if (output->copy == TEE_COPY_USER)
+        {
+            copied = pread(STDIN_FILENO, buff, count < TEE_BUFFER_SIZE ? count : TEE_BUFFER_SIZE, offset);
+            if (copied == -1 && errno == EINTR)
+                continue;
+            if (copied == -1)
+                report_error_and_exit("cannot read standard input\n");
+            if (copied == 0)
+                return; // Input was truncated
+            tee_write_output(output, buff, copied);
+            offset += copied;
+            count -= copied;
+            continue;
+        }
+
+        if (output->copy == TEE_COPY_RANGE)
+            copied = copy_file_range(STDIN_FILENO, &offset, output->fd, NULL, count, 0);
+        else
+            copied = sendfile(output->fd, STDIN_FILENO, &offset, count);
+        if (copied == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP && errno != EBADF)
+                report_error_and_exit("cannot write to specified file: %s\n", output->name);
+            output->copy = TEE_COPY_USER; // Not supported for this pair of files, offset is untouched
+            continue;
+        }
+        if (copied == 0)
+            return;
+        output->position += copied;
+        count -= copied;
+        if (output->policy.write_behind)
+            tee_write_behind(output);
+    }
+}
+
+static off_t tee_copy_regular_input(pTeeOutput outputs, size_t count, off_t offset, off_t size, unsigned char *buff)
+{
+    unsigned char *cloned = calloc(count, 1);
+    off_t done, chunk;
+
+    if (!cloned)
+        report_error_and_exit("cannot allocate memory for buffer\n");
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (outputs[i].policy.direct)
+            outputs[i].copy = TEE_COPY_USER;
+        else
+            outputs[i].copy = outputs[i].regular ? TEE_COPY_RANGE : TEE_COPY_SENDFILE;
+        // Kernel copy and clone do not accept O_APPEND, data is written at end of file explicitly
+        if (outputs[i].copy == TEE_COPY_RANGE && outputs[i].policy.append)
+        {
+            fcntl(outputs[i].fd, F_SETFL, fcntl(outputs[i].fd, F_GETFL) & ~O_APPEND);
+            outputs[i].position = lseek(outputs[i].fd, 0, SEEK_END);
+        }
+        cloned[i] = tee_clone_output(&outputs[i], offset, size) == 0;
+        if (cloned[i])
+            lseek(outputs[i].fd, outputs[i].position, SEEK_SET);
+    }
+
+    // Outputs advance together, so failed write stops execution as in regular copy
+    for (done = 0; done < size; done += chunk)
+    {
+        chunk = size - done < TEE_COPY_CHUNK_SIZE ? size - done : TEE_COPY_CHUNK_SIZE;
+        for (size_t i = 0; i < count; ++i)
+            if (!cloned[i])
+                tee_copy_output(&outputs[i], offset + done, chunk, buff);
+    }
+
+    for (size_t i = 0; i < count; ++i)
+        if (outputs[i].regular && outputs[i].policy.append)
+            fcntl(outputs[i].fd, F_SETFL, fcntl(outputs[i].fd, F_GETFL) | O_APPEND);
+    free(cloned);
+    return size;
+}
+
+#endif // __linux__
+
 static int tee_implementation(pArglist arg_list)
 {
-    uCharArray line = {0};
-    struct Files
+    struct Outputs
     {
         size_t capacity;
         size_t count;
-        FILE **array;
+        TeeOutput *array;
     };
-    struct Files files = {0};
-    size_t bytes_read, bytes_wrote, next_file;
-    FILE *hFile;
+    struct Outputs outputs = {0};
+    TeePolicy policy = {0};
+    TeeOutput output;
+    unsigned char *buff;
+    ssize_t bytes_read;
+    size_t next_file = 0;
     char *f;
-    bytes_read = bytes_wrote = next_file = 0;
+
+    policy.append = is_flag_set(arg_list, "-a") != 0;
+    policy.direct = is_flag_set(arg_list, "-D") != 0;
+    if (is_value_set(arg_list, "-p") && !(policy.preallocate = parse_size(get_value_by_key(arg_list, "-p"))))
+        report_error_and_exit("wrong value specified for -p '%s'\n", get_value_by_key(arg_list, "-p"));
+    if (is_value_set(arg_list, "-s") && !(policy.write_behind = parse_size(get_value_by_key(arg_list, "-s"))))
+        report_error_and_exit("wrong value specified for -s '%s'\n", get_value_by_key(arg_list, "-s"));
+#if !__linux__
+    if (policy.direct || policy.preallocate || policy.write_behind)
+        report_error_and_exit("options -p, -s and -D are supported only on Linux\n");
+#endif // __linux__
 
     while ((f = get_next_positional_value(arg_list, &next_file)) != NULL)
     {
-        hFile = fopen(f, is_flag_set(arg_list, "-a") ? "a" : "w");
-        if (!hFile)
+        if (tee_open_output(f, &policy, &output) == -1)
         {
             warning("cannot open file: %s\n", f);
             continue;
         }
-        append(FILE *, files, hFile);
+        append(TeeOutput, outputs, output);
+    }
+    append(TeeOutput, outputs, ((TeeOutput){.fd = STDOUT_FILENO, .name = "stdout"}));
+
+    buff = malloc(TEE_BUFFER_SIZE);
+    if (!buff)
+        report_error_and_exit("cannot allocate memory for buffer\n");
+
+#if __linux__
+    struct stat st;
+    off_t offset;
+    if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode) && (offset = lseek(STDIN_FILENO, 0, SEEK_CUR)) != -1 &&
+        offset < st.st_size)
+    {
+        // Data appended to input after this point is read below as usual
+        offset += tee_copy_regular_input(outputs.array, outputs.count, offset, st.st_size - offset, buff);
+        lseek(STDIN_FILENO, offset, SEEK_SET);
     }
-    append(FILE *, files, stdout);
+#endif // __linux__
 
-    while (read_line(&line, &bytes_read, stdin) != EOF)
+    while ((bytes_read = read(STDIN_FILENO, buff, TEE_BUFFER_SIZE)) != 0)
     {
-        for (size_t i = 0; i < files.count; ++i)
+        if (bytes_read == -1)
         {
-            bytes_wrote = fwrite(line.array, sizeof(unsigned char), line.count, files.array[i]);
-            if (bytes_wrote != (bytes_read + 2)) // +2 as read_line drops \n and do not count \0
-                report_error_and_exit("cannot write to specified file: %s\n", get_positional_argument(arg_list, i));
-            putc('\n', files.array[i]);
+            if (errno == EINTR)
+                continue;
+            report_error_and_exit("cannot read standard input\n");
         }
+        for (size_t i = 0; i < outputs.count; ++i)
+            tee_write_output(&outputs.array[i], buff, bytes_read);
     }
 
-    while ((hFile = pop(files, NULL)) != NULL)
-        fclose(hFile);
-    free_array(files);
-    free_array(line);
+    // Standard output is left open
+    for (size_t i = 0; i + 1 < outputs.count; ++i)
+        tee_close_output(&outputs.array[i]);
+    free_array(outputs);
+    free(buff);
 
     return 0;
 }
 
 #endif // TEE_HEADER_IMPLEMENTATION
 
-#endif // TEE_HEADER
\ No newline at end of file
+#endif // TEE_HEADER
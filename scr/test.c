@@ -1,6 +1,443 @@
+#define _GNU_SOURCE
+#define INTERNAL_UTILS_IMPLEMENTATION
+#define ARGPARSE_HEADER_IMPLEMENTATION
+#define OUTPUT_HEADER_IMPLEMENTATION
+#define UTF8_HEADER_IMPLEMENTATION
+#define DECOMPRESS_HEADER_IMPLEMENTATION
+#define WC_HEADER_IMPLEMENTATION
+#include "internal_utils.h"
+#include "wc.h"
+#include <sys/wait.h>
 
+#define TEST_PLAIN_SIZE (300 << 10)
+// bgzip splits input into blocks of at most this size
+#define TEST_BGZF_BLOCK_SIZE 65280
+#define TEST_UTF8_ROUNDS 100000
+#define TEST_UTF8_MAX_SIZE 512
 
-int main(int argc, char **argv)
+struct
+{
+    size_t count;
+    size_t capacity;
+    unsigned char *array;
+} typedef TestBuffer, *pTestBuffer;
+
+static int failures = 0;
+static unsigned long long random_state = 0x9E3779B97F4A7C15ULL;
+
+// xorshift64, sequence is the same on every run
+static unsigned long long test_random(void)
+{
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+static void test_push(pTestBuffer buffer, const unsigned char *buff, size_t size)
+{
+    if (buffer->count + size > buffer->capacity)
+    {
+        buffer->capacity = (buffer->count + size) * 2;
+        if (!(buffer->array = realloc(buffer->array, buffer->capacity)))
+            report_error_and_exit("cannot allocate memory for test buffer\n");
+    }
+    memcpy(buffer->array + buffer->count, buff, size);
+    buffer->count += size;
+}
+
+static int test_write_all(int fd, const unsigned char *buff, size_t size)
 {
+    ssize_t bytes_wrote;
+
+    for (; size; buff += bytes_wrote, size -= bytes_wrote)
+        if ((bytes_wrote = write(fd, buff, size)) == -1)
+            return -1;
     return 0;
-}
\ No newline at end of file
+}
+
+static void test_sink(void *context, const unsigned char *buff, size_t size)
+{
+    test_push(context, buff, size);
+}
+
+// Appends deflated data, raw deflate for window_bits -15 or gzip member for 31
+static void test_deflate(pTestBuffer out, const unsigned char *buff, size_t size, int window_bits)
+{
+    z_stream z = {0};
+    unsigned char chunk[1 << 14];
+
+    if (deflateInit2(&z, 6, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        report_error_and_exit("cannot initialize deflate\n");
+    z.next_in = (unsigned char *)buff;
+    z.avail_in = size;
+    do
+    {
+        z.next_out = chunk;
+        z.avail_out = sizeof(chunk);
+        deflate(&z, Z_FINISH);
+        test_push(out, chunk, sizeof(chunk) - z.avail_out);
+    } while (z.avail_out == 0);
+    deflateEnd(&z);
+}
+
+// Gzip member with BC extra subfield holding block size minus one, as written by bgzip
+static void test_bgzf_block(pTestBuffer out, const unsigned char *buff, size_t size)
+{
+    unsigned char header[18] = {0x1F, 0x8B, 8, 4, 0, 0, 0, 0, 0, 0xFF, 6, 0, 'B', 'C', 2, 0, 0, 0};
+    unsigned long crc = crc32(0, buff, size);
+    size_t start = out->count, block_size;
+
+    test_push(out, header, sizeof(header));
+    test_deflate(out, buff, size, -15);
+    for (int i = 0; i < 4; ++i)
+        test_push(out, (unsigned char[]){(crc >> i * 8) & 0xFF}, 1);
+    for (int i = 0; i < 4; ++i)
+        test_push(out, (unsigned char[]){(size >> i * 8) & 0xFF}, 1);
+    block_size = out->count - start - 1;
+    out->array[start + 16] = block_size & 0xFF;
+    out->array[start + 17] = block_size >> 8;
+}
+
+// Decompresses fixture from regular file, or from pipe when piped is set, the way wc does
+// and compares it with plain input
+static void test_fixture(const char *name, pTestBuffer fixture, pTestBuffer plain, int format, size_t workers,
+                         unsigned char piped, int expected_status)
+{
+    char path[] = "/tmp/test_fixture_XXXXXX";
+    static unsigned char prefix[WC_BUFFER_SIZE];
+    TestBuffer result = {0};
+    size_t prefix_size;
+    struct stat st;
+    int fd, pipe_fds[2], detected, status;
+    pid_t writer = 0;
+
+    if (piped)
+    {
+        if (pipe(pipe_fds) == -1 || (writer = fork()) == -1)
+            report_error_and_exit("cannot create fixture pipe\n");
+        if (!writer)
+        {
+            close(pipe_fds[0]);
+            test_write_all(pipe_fds[1], fixture->array, fixture->count);
+            _exit(0);
+        }
+        close(pipe_fds[1]);
+        fd = pipe_fds[0];
+    }
+    else
+    {
+        if ((fd = mkstemp(path)) == -1)
+            report_error_and_exit("cannot create fixture file\n");
+        unlink(path);
+        if (test_write_all(fd, fixture->array, fixture->count) == -1)
+            report_error_and_exit("cannot write fixture file\n");
+        lseek(fd, 0, SEEK_SET);
+    }
+
+    fstat(fd, &st);
+    detected = decompress_detect_fd(fd, prefix, sizeof(prefix), &prefix_size);
+    status = decompress_fd(fd, &st, prefix, prefix_size, detected, workers, test_sink, &result);
+    close(fd);
+    if (writer)
+        waitpid(writer, NULL, 0);
+
+    if (detected != format)
+        fprintf(stderr, "FAIL %s: detected format %d, expected %d\n", name, detected, format);
+    else if (status != expected_status)
+        fprintf(stderr, "FAIL %s: status %d, expected %d\n", name, status, expected_status);
+    else if (!expected_status && (result.count != plain->count || memcmp(result.array, plain->array, plain->count)))
+        fprintf(stderr, "FAIL %s: decompressed %zu bytes differ from %zu plain bytes\n", name, result.count,
+                plain->count);
+    else
+    {
+        printf("ok %s\n", name);
+        free(result.array);
+        return;
+    }
+    failures++;
+    free(result.array);
+}
+
+#ifdef DECOMPRESS_WITH_ZSTD
+// Appends one zstd frame, content size is stored so frames can be decompressed by workers
+static void test_zstd_frame(pTestBuffer out, const unsigned char *buff, size_t size)
+{
+    size_t bound = ZSTD_compressBound(size), compressed;
+
+    if (out->count + bound > out->capacity)
+    {
+        out->capacity = (out->count + bound) * 2;
+        if (!(out->array = realloc(out->array, out->capacity)))
+            report_error_and_exit("cannot allocate memory for test buffer\n");
+    }
+    compressed = ZSTD_compress(out->array + out->count, bound, buff, size, 3);
+    if (ZSTD_isError(compressed))
+        report_error_and_exit("cannot compress zstd fixture\n");
+    out->count += compressed;
+}
+
+static void test_zstd(pTestBuffer plain)
+{
+    TestBuffer single = {0}, frames = {0};
+
+    test_zstd_frame(&single, plain->array, plain->count);
+    for (size_t offset = 0; offset < plain->count; offset += TEST_BGZF_BLOCK_SIZE)
+        test_zstd_frame(&frames, plain->array + offset,
+                        plain->count - offset < TEST_BGZF_BLOCK_SIZE ? plain->count - offset : TEST_BGZF_BLOCK_SIZE);
+
+    test_fixture("zstd single frame", &single, plain, DECOMPRESS_ZSTD, 4, 0, 0);
+    test_fixture("zstd frames", &frames, plain, DECOMPRESS_ZSTD, 1, 0, 0);
+    test_fixture("zstd frames parallel", &frames, plain, DECOMPRESS_ZSTD, 4, 0, 0);
+    test_fixture("zstd frames piped", &frames, plain, DECOMPRESS_ZSTD, 4, 1, 0);
+    single.count /= 2;
+    test_fixture("zstd single frame truncated", &single, plain, DECOMPRESS_ZSTD, 1, 0, DECOMPRESS_ERROR_DATA);
+    frames.count -= frames.count / 3;
+    test_fixture("zstd frames truncated", &frames, plain, DECOMPRESS_ZSTD, 4, 0, DECOMPRESS_ERROR_DATA);
+
+    free(single.array);
+    free(frames.array);
+}
+#else
+// Zstandard input is still recognised, so it is reported instead of counted as plain data
+static void test_zstd(pTestBuffer plain)
+{
+    TestBuffer frame = {0};
+
+    test_push(&frame, (const unsigned char *)"\x28\xB5\x2F\xFD\x04\x58\x01\x00\x00x\n", 11);
+    test_fixture("zstd not built in", &frame, plain, DECOMPRESS_ZSTD, 1, 0, DECOMPRESS_ERROR_UNSUPPORTED);
+    free(frame.array);
+}
+#endif // DECOMPRESS_WITH_ZSTD
+
+static void test_decompress(void)
+{
+    TestBuffer plain = {0}, gzip = {0}, members = {0}, bgzf = {0};
+    char line[64];
+    int length;
+
+    // Text with multibyte characters and empty lines, reproducible between runs
+    for (size_t i = 0; plain.count < TEST_PLAIN_SIZE; ++i)
+    {
+        length = snprintf(line, sizeof(line), i % 7 ? "line %zu caf\xC3\xA9 \xE2\x82\xAC%zu\n" : "\n", i, i * 31);
+        test_push(&plain, (unsigned char *)line, length);
+    }
+
+    test_deflate(&gzip, plain.array, plain.count, 31);
+    test_deflate(&members, plain.array, plain.count / 3, 31);
+    test_deflate(&members, plain.array + plain.count / 3, plain.count - plain.count / 3, 31);
+    for (size_t offset = 0; offset < plain.count; offset += TEST_BGZF_BLOCK_SIZE)
+        test_bgzf_block(&bgzf, plain.array + offset,
+                        plain.count - offset < TEST_BGZF_BLOCK_SIZE ? plain.count - offset : TEST_BGZF_BLOCK_SIZE);
+    // BGZF end of file marker is an empty block
+    test_bgzf_block(&bgzf, NULL, 0);
+
+    test_fixture("gzip", &gzip, &plain, DECOMPRESS_GZIP, 1, 0, 0);
+    test_fixture("gzip piped", &gzip, &plain, DECOMPRESS_GZIP, 1, 1, 0);
+    test_fixture("gzip multi-member", &members, &plain, DECOMPRESS_GZIP, 1, 0, 0);
+    test_fixture("bgzf", &bgzf, &plain, DECOMPRESS_BGZF, 1, 0, 0);
+    test_fixture("bgzf parallel", &bgzf, &plain, DECOMPRESS_BGZF, 4, 0, 0);
+    test_fixture("bgzf piped", &bgzf, &plain, DECOMPRESS_BGZF, 4, 1, 0);
+
+    gzip.count /= 2;
+    test_fixture("gzip truncated", &gzip, &plain, DECOMPRESS_GZIP, 1, 0, DECOMPRESS_ERROR_DATA);
+    bgzf.count -= bgzf.count / 3;
+    test_fixture("bgzf truncated", &bgzf, &plain, DECOMPRESS_BGZF, 4, 0, DECOMPRESS_ERROR_DATA);
+
+    test_zstd(&plain);
+
+    free(plain.array);
+    free(gzip.array);
+    free(members.array);
+    free(bgzf.array);
+}
+
+// Appends valid sequence, ill-formed or boundary bytes, mostly ASCII to reach vectorized path
+static size_t test_utf8_piece(unsigned char *buff)
+{
+    static const unsigned char edges[] = {0x80, 0xBF, 0xC0, 0xC1, 0xC2, 0xDF, 0xE0, 0xED,
+                                          0xEF, 0xF0, 0xF4, 0xF5, 0xFF, 0x9F, 0xA0, 0x8F};
+    unsigned long long r = test_random();
+    unsigned int cp;
+
+    switch (r % 16)
+    {
+    case 0:
+        buff[0] = edges[(r >> 8) % sizeof(edges)];
+        return 1;
+    case 1:
+        buff[0] = r >> 8;
+        return 1;
+    case 2:
+        // Sequence cut short by one byte
+        cp = 0x800 + (r >> 8) % 0xF800;
+        buff[0] = 0xE0 | cp >> 12;
+        buff[1] = 0x80 | (cp >> 6 & 0x3F);
+        return 2;
+    case 3:
+    case 4:
+        cp = 0x80 + (r >> 8) % 0x780;
+        buff[0] = 0xC0 | cp >> 6;
+        buff[1] = 0x80 | (cp & 0x3F);
+        return 2;
+    case 5:
+    case 6:
+        // Surrogates are included and must be rejected
+        cp = 0x800 + (r >> 8) % 0xF800;
+        buff[0] = 0xE0 | cp >> 12;
+        buff[1] = 0x80 | (cp >> 6 & 0x3F);
+        buff[2] = 0x80 | (cp & 0x3F);
+        return 3;
+    case 7:
+        // Up to U+13FFFF, above U+10FFFF must be rejected
+        cp = 0x10000 + (r >> 8) % 0x130000;
+        buff[0] = 0xF0 | cp >> 18;
+        buff[1] = 0x80 | (cp >> 12 & 0x3F);
+        buff[2] = 0x80 | (cp >> 6 & 0x3F);
+        buff[3] = 0x80 | (cp & 0x3F);
+        return 4;
+    default:
+        buff[0] = ' ' + (r >> 8) % 95;
+        return 1;
+    }
+}
+
+// Vectorized counter fed in random blocks must agree with scalar decoder fed whole input
+static void test_utf8(void)
+{
+    unsigned char buff[TEST_UTF8_MAX_SIZE + 4];
+    Utf8Counter expected, counter;
+    size_t size, chunk;
+
+    for (size_t round = 0; round < TEST_UTF8_ROUNDS; ++round)
+    {
+        size_t limit = test_random() % TEST_UTF8_MAX_SIZE;
+        for (size = 0; size < limit;)
+            size += test_utf8_piece(buff + size);
+
+        memset(&expected, 0, sizeof(expected));
+        utf8_scalar(&expected, buff, size);
+        utf8_count_finish(&expected);
+
+        memset(&counter, 0, sizeof(counter));
+        for (size_t offset = 0; offset < size; offset += chunk)
+        {
+            chunk = 1 + test_random() % (test_random() & 1 ? 4 * UTF8_CHUNK_SIZE : 3);
+            chunk = chunk < size - offset ? chunk : size - offset;
+            utf8_count(&counter, buff + offset, chunk);
+        }
+        utf8_count_finish(&counter);
+
+        if (counter.chars != expected.chars || counter.invalid != expected.invalid)
+        {
+            fprintf(stderr, "FAIL utf8 round %zu: %zu chars %zu invalid, scalar gives %zu chars %zu invalid\n", round,
+                    counter.chars, counter.invalid, expected.chars, expected.invalid);
+            failures++;
+            return;
+        }
+    }
+    printf("ok utf8 blocks against scalar\n");
+}
+
+// U+3000 and U+2003 split words, no-break spaces U+00A0 and U+202F do not, input is split at every offset
+static void test_unicode_words(void)
+{
+    const unsigned char text[] = "\xD0\xBE\xD0\xB4\xD0\xB8\xD0\xBD\xE3\x80\x80\xD0\xB4\xD0\xB2\xD0\xB0\xC2\xA0"
+                                 "\xD1\x82\xD1\x80\xD0\xB8\xE2\x80\x83"
+                                 "four\xE2\x80\xAF"
+                                 "five\n";
+    WcOptions options = {.counters = WC_WORDS | WC_CHARS | WC_UNICODE_WORDS,
+                         .kernel = wc_kernels[WC_KERNEL_WORDS | WC_KERNEL_UNICODE]};
+    size_t size = sizeof(text) - 1;
+    WcState state;
+
+    for (size_t split = 0; split <= size; ++split)
+    {
+        memset(&state, 0, sizeof(state));
+        wc_feed(&state, &options, text, split);
+        wc_feed(&state, &options, text + split, size - split);
+        wc_finish(&state, &options);
+        if (state.counters.words != 3 || state.counters.chars != 23)
+        {
+            fprintf(stderr, "FAIL unicode words split at %zu: %zu words %zu chars, expected 3 words 23 chars\n", split,
+                    state.counters.words, state.counters.chars);
+            failures++;
+            return;
+        }
+    }
+    printf("ok unicode words\n");
+}
+
+// Ill-formed UTF-8 in JSON string is replaced, well-formed sequences are kept as is
+static void test_output_json(void)
+{
+    const char expected[] = "{\"name\":\"a\\ufffd\\ufffdb\xC3\xA9\\u0001\\\"\\ufffd\\ufffd\\ufffd\xF0\x9F\x98\x80\"}\n";
+    static Output out;
+    char result[sizeof(expected)] = {0};
+    int pipe_fds[2];
+
+    if (pipe(pipe_fds) == -1)
+        report_error_and_exit("cannot create pipe\n");
+    output_init(&out, pipe_fds[1], OUTPUT_JSON, NULL, 0);
+    // Lone continuation, truncated sequence, surrogate U+D800 and 4 byte sequence
+    output_field_str(&out, "name", "a\x80\xC3" "b\xC3\xA9\x01\"\xED\xA0\x80\xF0\x9F\x98\x80");
+    output_end_record(&out);
+    close(pipe_fds[1]);
+    read(pipe_fds[0], result, sizeof(result) - 1);
+    close(pipe_fds[0]);
+
+    if (strcmp(result, expected))
+    {
+        fprintf(stderr, "FAIL output json: %s", result);
+        failures++;
+        return;
+    }
+    printf("ok output json\n");
+}
+
+// Procfs reports size 0 and returns one page per read, every read until end of file must be counted
+static void test_short_reads(const char *path)
+{
+    WcOptions options = {.counters = WC_LINES | WC_BYTES, .kernel = wc_kernels[WC_KERNEL_LINES], .workers = 1};
+    static unsigned char buff[WC_BUFFER_SIZE];
+    size_t lines = 0, bytes = 0;
+    WcState state = {0};
+    ssize_t bytes_read;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+    {
+        printf("skip short reads, cannot open %s\n", path);
+        return;
+    }
+    while ((bytes_read = read(fd, buff, sizeof(buff))) > 0)
+    {
+        bytes += bytes_read;
+        for (ssize_t i = 0; i < bytes_read; ++i)
+            lines += buff[i] == '\n';
+    }
+    lseek(fd, 0, SEEK_SET);
+    wc_count_fd(fd, &state, &options, buff, sizeof(buff), 1);
+    wc_finish(&state, &options);
+    close(fd);
+
+    if (state.counters.lines != lines || state.counters.bytes != bytes)
+    {
+        fprintf(stderr, "FAIL short reads %s: %zu lines %zu bytes, expected %zu lines %zu bytes\n", path,
+                state.counters.lines, state.counters.bytes, lines, bytes);
+        failures++;
+        return;
+    }
+    printf("ok short reads %s\n", path);
+}
+
+int main(int argc, char **argv)
+{
+    test_output_json();
+    test_utf8();
+    test_unicode_words();
+    // Contents do not change between reads
+    test_short_reads("/proc/kallsyms");
+    test_decompress();
+    return failures != 0;
+}
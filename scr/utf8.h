@@ -0,0 +1,302 @@
+// Notes:
+// UTF-8 RFC:        https://datatracker.ietf.org/doc/html/rfc3629
+// Validation tables: "Validating UTF-8 In Less Than One Instruction Per Byte", Keiser & Lemire (simdutf)
+
+#include "stdlib.h"
+#include "string.h"
+
+#ifndef UTF8_HEADER
+#define UTF8_HEADER
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define UTF8_HAVE_X86 1
+#else
+#define UTF8_HAVE_X86 0
+#endif // x86
+
+#define UTF8_CHUNK_SIZE 16
+
+// Streaming UTF-8 character counter and validator.
+// Input can be fed in blocks of any size, sequences split between blocks are handled.
+// Initialize with zeros, call utf8_count_finish after the last block.
+struct
+{
+    size_t chars;   // Number of valid code points
+    size_t invalid; // Number of ill-formed sequences (maximal subparts, as in Unicode 3.9 U+FFFD substitution)
+    // Scalar decoder state, used when vectorized path is not possible
+    unsigned char need;
+    unsigned char lower;
+    unsigned char upper;
+    // Bytes of incomplete sequence at the end of last chunk accepted by vectorized path,
+    // lead byte of such sequence is already counted in chars.
+    unsigned char pending;
+    // Last chunk accepted by vectorized path with incomplete sequence at the end
+    unsigned char tail[UTF8_CHUNK_SIZE];
+} typedef Utf8Counter, *pUtf8Counter;
+
+// Counts characters and ill-formed sequences in buff, updates counter
+void utf8_count(pUtf8Counter counter, const unsigned char *buff, size_t size);
+// Flushes incomplete trailing sequence as ill-formed, call once at end of input
+void utf8_count_finish(pUtf8Counter counter);
+// Returns length of sequence started by lead byte, 0 if byte cannot start a sequence
+static inline size_t utf8_sequence_length(unsigned char lead);
+// Sets range allowed for byte following the lead byte of multi byte sequence
+static inline void utf8_second_byte_bounds(unsigned char lead, unsigned char *lower, unsigned char *upper);
+// Feeds one byte to scalar decoder
+static inline void utf8_scalar_step(pUtf8Counter counter, unsigned char c);
+static void utf8_scalar(pUtf8Counter counter, const unsigned char *buff, size_t size);
+// Moves counter from vectorized state to scalar decoder state
+static void utf8_drop_pending(pUtf8Counter counter);
+
+#ifdef UTF8_HEADER_IMPLEMENTATION
+
+static inline size_t utf8_sequence_length(unsigned char lead)
+{
+    if (lead < 0x80)
+        return 1;
+    if (lead < 0xC2)
+        return 0;
+    if (lead < 0xE0)
+        return 2;
+    if (lead < 0xF0)
+        return 3;
+    if (lead < 0xF5)
+        return 4;
+    return 0;
+}
+
+static inline void utf8_second_byte_bounds(unsigned char lead, unsigned char *lower, unsigned char *upper)
+{
+    *lower = 0x80;
+    *upper = 0xBF;
+    if (lead == 0xE0)
+        *lower = 0xA0; // Overlong
+    else if (lead == 0xED)
+        *upper = 0x9F; // Surrogates
+    else if (lead == 0xF0)
+        *lower = 0x90; // Overlong
+    else if (lead == 0xF4)
+        *upper = 0x8F; // Above U+10FFFF
+}
+
+static inline void utf8_scalar_step(pUtf8Counter counter, unsigned char c)
+{
+    if (counter->need)
+    {
+        if (c >= counter->lower && c <= counter->upper)
+        {
+            counter->lower = 0x80;
+            counter->upper = 0xBF;
+            if (--counter->need == 0)
+                counter->chars++;
+            return;
+        }
+        // Sequence interrupted, byte is reprocessed as start of a new one
+        counter->invalid++;
+        counter->need = 0;
+    }
+
+    switch (counter->need = utf8_sequence_length(c))
+    {
+    case 1:
+        counter->need = 0;
+        counter->chars++;
+        return;
+    case 0:
+        counter->invalid++;
+        return;
+    default:
+        counter->need--;
+        utf8_second_byte_bounds(c, &counter->lower, &counter->upper);
+        return;
+    }
+}
+
+static void utf8_scalar(pUtf8Counter counter, const unsigned char *buff, size_t size)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        if (buff[i] < 0x80 && !counter->need)
+        {
+            counter->chars++;
+            continue;
+        }
+        utf8_scalar_step(counter, buff[i]);
+    }
+}
+
+static void utf8_drop_pending(pUtf8Counter counter)
+{
+    unsigned char pending = counter->pending;
+
+    if (!pending)
+        return;
+    counter->pending = 0;
+    counter->chars--; // Lead byte was counted optimistically
+    utf8_scalar(counter, counter->tail + UTF8_CHUNK_SIZE - pending, pending);
+}
+
+#if UTF8_HAVE_X86
+
+// Error classes, byte 1 is previous byte and byte 2 is current one
+#define UTF8_TOO_SHORT (1 << 0)  // 11______ 0_______, 11______ 11______
+#define UTF8_TOO_LONG (1 << 1)   // 0_______ 10______
+#define UTF8_OVERLONG_3 (1 << 2) // 11100000 100_____
+#define UTF8_TOO_LARGE (1 << 3)  // 11110100 1001____, 11110100 101_____, 11110101+ 10______
+#define UTF8_SURROGATE (1 << 4)  // 11101101 101_____
+#define UTF8_OVERLONG_2 (1 << 5) // 1100000_ 10______
+#define UTF8_TOO_LARGE_1000 (1 << 6)
+#define UTF8_OVERLONG_4 (1 << 6) // 11110000 1000____
+#define UTF8_TWO_CONTS (1 << 7)  // 10______ 10______
+#define UTF8_CARRY (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+// Returns non zero if chunk has ill-formed sequence, lookback is previous 16 bytes of input.
+// Incomplete sequence at the end of chunk is not an error here.
+__attribute__((target("ssse3"))) static int utf8_chunk_has_error_ssse3(__m128i input, __m128i lookback)
+{
+    const __m128i low_nibble = _mm_set1_epi8(0x0F);
+    const __m128i byte_1_high_table = _mm_setr_epi8(
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+        UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+        UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+        UTF8_TOO_SHORT,
+        UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+        UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4);
+    const __m128i byte_1_low_table = _mm_setr_epi8(
+        UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+        UTF8_CARRY | UTF8_OVERLONG_2,
+        UTF8_CARRY,
+        UTF8_CARRY,
+        UTF8_CARRY | UTF8_TOO_LARGE,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+        UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000);
+    const __m128i byte_2_high_table = _mm_setr_epi8(
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+        UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE,
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT);
+
+    __m128i prev1 = _mm_alignr_epi8(input, lookback, 15);
+    __m128i byte_1_high = _mm_shuffle_epi8(byte_1_high_table, _mm_and_si128(_mm_srli_epi16(prev1, 4), low_nibble));
+    __m128i byte_1_low = _mm_shuffle_epi8(byte_1_low_table, _mm_and_si128(prev1, low_nibble));
+    __m128i byte_2_high = _mm_shuffle_epi8(byte_2_high_table, _mm_and_si128(_mm_srli_epi16(input, 4), low_nibble));
+    __m128i special_cases = _mm_and_si128(_mm_and_si128(byte_1_high, byte_1_low), byte_2_high);
+
+    // Third and fourth bytes of sequences must be continuations, checked against lead 2 and 3 bytes back
+    __m128i prev2 = _mm_alignr_epi8(input, lookback, 14);
+    __m128i prev3 = _mm_alignr_epi8(input, lookback, 13);
+    __m128i is_third_byte = _mm_subs_epu8(prev2, _mm_set1_epi8((char)(0xE0 - 0x80)));
+    __m128i is_fourth_byte = _mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xF0 - 0x80)));
+    __m128i must23_80 = _mm_and_si128(_mm_or_si128(is_third_byte, is_fourth_byte), _mm_set1_epi8((char)0x80));
+    __m128i error = _mm_xor_si128(must23_80, special_cases);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) != 0xFFFF;
+}
+
+// Number of bytes in chunk that are not continuation bytes (10______)
+static inline size_t utf8_count_leads_sse2(__m128i input)
+{
+    __m128i continuation = _mm_cmplt_epi8(input, _mm_set1_epi8((char)0xC0));
+    return UTF8_CHUNK_SIZE - __builtin_popcount(_mm_movemask_epi8(continuation));
+}
+
+// Length of incomplete sequence at the end of valid chunk.
+// Last byte that cannot start a sequence is reported too, it is checked only against the next byte.
+static inline unsigned char utf8_incomplete_tail(const unsigned char *chunk_end)
+{
+    size_t length;
+
+    for (size_t k = 1; k <= 3; ++k)
+    {
+        unsigned char c = chunk_end[-(long)k];
+        if (c >= 0xC0)
+        {
+            length = utf8_sequence_length(c);
+            return (length == 0 || length > k) ? k : 0;
+        }
+        if (c < 0x80)
+            return 0;
+    }
+    return 0;
+}
+
+__attribute__((target("ssse3"))) static size_t utf8_count_ssse3(pUtf8Counter counter, const unsigned char *buff, size_t size)
+{
+    // Lookback matters only for sequence left incomplete by previous chunk,
+    // otherwise input is on character boundary and ASCII lookback is equivalent.
+    __m128i lookback = counter->pending ? _mm_loadu_si128((const __m128i *)counter->tail) : _mm_setzero_si128();
+    size_t i;
+
+    for (i = 0; i + UTF8_CHUNK_SIZE <= size; i += UTF8_CHUNK_SIZE)
+    {
+        __m128i input = _mm_loadu_si128((const __m128i *)(buff + i));
+
+        if (counter->need)
+            utf8_scalar(counter, buff + i, UTF8_CHUNK_SIZE); // Scalar decoder owns sequence split before this chunk
+        else if (!_mm_movemask_epi8(input) && !counter->pending)
+            counter->chars += UTF8_CHUNK_SIZE; // ASCII
+        else if (!utf8_chunk_has_error_ssse3(input, lookback))
+        {
+            counter->chars += utf8_count_leads_sse2(input);
+            counter->pending = utf8_incomplete_tail(buff + i + UTF8_CHUNK_SIZE);
+        }
+        else
+        {
+            utf8_drop_pending(counter);
+            utf8_scalar(counter, buff + i, UTF8_CHUNK_SIZE);
+        }
+
+        if (counter->pending)
+        {
+            lookback = input;
+            _mm_storeu_si128((__m128i *)counter->tail, input);
+        }
+        else
+            lookback = _mm_setzero_si128();
+    }
+    return i;
+}
+
+#endif // UTF8_HAVE_X86
+
+void utf8_count(pUtf8Counter counter, const unsigned char *buff, size_t size)
+{
+    size_t done = 0;
+#if UTF8_HAVE_X86
+    // CPU model is filled in by libgcc before main, so this check is a plain load and safe from any thread
+    if (__builtin_cpu_supports("ssse3"))
+        done = utf8_count_ssse3(counter, buff, size);
+#endif // UTF8_HAVE_X86
+    if (done == size)
+        return;
+    utf8_drop_pending(counter);
+    utf8_scalar(counter, buff + done, size - done);
+}
+
+void utf8_count_finish(pUtf8Counter counter)
+{
+    utf8_drop_pending(counter);
+    if (counter->need)
+    {
+        counter->invalid++;
+        counter->need = 0;
+    }
+}
+
+#endif // UTF8_HEADER_IMPLEMENTATION
+
+#endif // UTF8_HEADER
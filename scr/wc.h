@@ -1,30 +1,277 @@
 #include "internal_utils.h"
 #include "argparse.h"
 #include "ctype.h"
+#include "utf8.h"
+#include "output.h"
+#include "decompress.h"
+#include "limits.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if __linux__
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#if !defined(WC_WITHOUT_IO_URING) && defined(SYS_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+#define WC_HAVE_IO_URING 1
+#endif
+#endif // __linux__
 
 #ifndef WC_HEADER
 #define WC_HEADER
 
+#define WC_BUFFER_SIZE (1 << 16)
+// Bucket 0 holds empty lines, bucket k holds lines with length in [2^(k-1), 2^k - 1]
+#define WC_HISTOGRAM_BUCKETS (sizeof(size_t) * 8 + 1)
+
+// Counters requested on command line
+#define WC_LINES (1 << 0)
+#define WC_WORDS (1 << 1)
+#define WC_CHARS (1 << 2)
+#define WC_BYTES (1 << 3)
+#define WC_MAX_LINE_LENGTH (1 << 4)
+#define WC_HISTOGRAM (1 << 5)
+#define WC_UNICODE_WORDS (1 << 6)
+#define WC_RAW (1 << 7) // Compressed input is counted as is
+
+// Work done by counting kernel, kernel is generated for every combination
+#define WC_KERNEL_LINES (1 << 0)
+#define WC_KERNEL_LENGTHS (1 << 1)
+#define WC_KERNEL_WORDS (1 << 2)
+#define WC_KERNEL_UNICODE (1 << 3)
+#define WC_KERNELS (1 << 4)
+
+struct
+{
+    size_t lines;
+    size_t words;
+    size_t bytes;
+    size_t chars;
+    size_t invalid; // Ill-formed UTF-8 sequences, not included in chars
+    size_t max_line_length; // In bytes, without newline
+    size_t line_lengths[WC_HISTOGRAM_BUCKETS];
+} typedef WcCounters, *pWcCounters;
+
+// Counting state of one input, carried between read blocks
+struct
+{
+    WcCounters counters;
+    size_t line_length; // Bytes of current line seen in previous blocks
+    unsigned char in_word;
+    // Code point decoder used for Unicode aware word splitting
+    unsigned char cp_need;
+    unsigned char cp_lower;
+    unsigned char cp_upper;
+    unsigned int cp;
+    Utf8Counter utf8;
+} typedef WcState, *pWcState;
+
+// Counts lines, words and line lengths in the block, state is kept between blocks. Bytes are counted by caller.
+typedef void (*WcKernel)(pWcState state, const unsigned char *buff, size_t size);
+
+// Command line resolved once per run
+struct
+{
+    unsigned int counters; // WC_* flags
+    WcKernel kernel;
+    pOutput output;
+    size_t workers; // Threads for -r and for decompression of BGZF and zstd frames
+} typedef WcOptions, *pWcOptions;
+
+struct
+{
+    pWcState state;
+    pWcOptions options;
+} typedef WcFeed, *pWcFeed;
+
+#if __linux__
+// Directories kept open between parent scan and own scan, rest is opened by path
+#define WC_WALK_MAX_OPEN_DIRS 256
+// Subdirectories found by worker are queued in batches
+#define WC_WALK_PUSH_BATCH 64
+#define WC_WALK_DENTS_SIZE (1 << 15)
+
+// Directory of recursive walk, finished subdirectories add their counters to parent atomically
+struct WcDir
+{
+    struct WcDir *parent;
+    char *path;
+    int fd;         // Opened relative to parent or -1
+    size_t pending; // Own scan and subdirectories not finished yet
+    WcCounters subtree;
+} typedef WcDir, *pWcDir;
+
+// State shared by walk workers, lock protects queue and active only
+struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct
+    {
+        size_t count;
+        size_t capacity;
+        pWcDir *array;
+    } queue;
+    size_t active; // Workers scanning a directory
+    size_t open_dirs;
+    WcCounters total;
+} typedef WcWalk, *pWcWalk;
+
+#if WC_HAVE_IO_URING
+// Files of one directory are opened and read together, rest of bigger files is read as usual. Second read
+// finds end of small files instead of statx, which io_uring runs in a worker thread
+#define WC_RING_BATCH 32
+#define WC_RING_READ_SIZE (1 << 15)
+// Request kind in low bits of user_data, file index in the rest
+#define WC_RING_OPEN 0
+#define WC_RING_READ 1
+#define WC_RING_READ_END 2
+#define WC_RING_CLOSE 3
+
+// io_uring queues mapped from kernel, used by one worker only
+struct
+{
+    int fd; // -1 if io_uring is not used
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    void *cq_map;
+    size_t sq_map_size;
+    size_t cq_map_size;
+    size_t sqes_size;
+    unsigned int queued;   // Requests not submitted yet
+    unsigned int inflight; // Submitted requests not completed yet
+} typedef WcRing, *pWcRing;
+
+// File of batch with results of its requests
+struct
+{
+    char *name; // Points to dents, batch is finished before next getdents64
+    int fd;     // Or -errno
+    ssize_t bytes_read;
+    ssize_t end_read; // 0 at end of file
+} typedef WcRingFile, *pWcRingFile;
+
+// First read was short, second read is queued for the rest of buffer
+#define WC_RING_READS_END(file) ((file)->bytes_read > 0 && (file)->bytes_read < WC_RING_READ_SIZE)
+#endif // WC_HAVE_IO_URING
+
+// Worker of recursive walk with its own buffers and output
+struct
+{
+    pWcWalk walk;
+    WcOptions options;
+    Output output;
+    char path[PATH_MAX + 1];
+    unsigned char dents[WC_WALK_DENTS_SIZE];
+    unsigned char buff[WC_BUFFER_SIZE];
+#if WC_HAVE_IO_URING
+    WcRing ring;
+    size_t files_count;
+    WcRingFile files[WC_RING_BATCH];
+    unsigned char ring_buffs[WC_RING_BATCH][WC_RING_READ_SIZE];
+#endif
+} typedef WcWalker, *pWcWalker;
+#endif // __linux__
+
 // Entry for wc program
 int wc_main(int argc, char **argv);
-static void wc_on_file(char *f, size_t *total_lines, size_t *total_words, size_t *total_bytes, pArglist arg_list);
+static void wc_on_file(char *f, pWcCounters total, pWcOptions options);
 static void wc_implementation(pArglist arg_list);
+// Translates flags to WC_* counters, selects kernel doing only required work and sets up output
+static void wc_resolve_options(pArglist arg_list, pWcOptions options, pOutput output);
+// Passes block through selected kernel and UTF-8 counter
+static void wc_feed(pWcState state, pWcOptions options, const unsigned char *buff, size_t size);
+// Accounts incomplete sequence and line at the end of input
+static void wc_finish(pWcState state, pWcOptions options);
+// Kernel body, features are compile time constants in generated kernels
+static inline __attribute__((always_inline)) void wc_kernel(pWcState state, const unsigned char *buff, size_t size, const unsigned int features);
+static size_t wc_count_newlines(const unsigned char *buff, size_t size);
+// Non space character seen, starts a word if not in one
+static inline void wc_count_word_char(pWcState state);
+// Words are split on ASCII white space and on Unicode White_Space characters except no-break spaces
+static int wc_is_unicode_space(unsigned int cp);
+// Updates max line length and histogram with length of finished line
+static inline void wc_count_line_length(pWcCounters counters, size_t length);
+static void wc_add_counters(pWcCounters total, pWcCounters counters);
+static void wc_print_counters(pWcCounters counters, char *name, pWcOptions options);
+static void wc_print_histogram(pWcCounters counters, char *name, pWcOptions options);
+// Reads fd to the end feeding counting engine, returns -1 on read error.
+// Reading stops once remaining bytes are read, 0 if not known. Short read alone is not end of file,
+// procfs, sysfs and network filesystems return less or report size 0.
+static int wc_read_fd(int fd, pWcState state, pWcOptions options, unsigned char *buff, size_t size, off_t remaining);
+// Counts fd from current offset, gzip and zstd input is decompressed unless -Z is set. buff is used for
+// reading, first block read detects format, so small file takes fstat and one read.
+// Returns 0 or DECOMPRESS_ERROR_*.
+static int wc_count_fd(int fd, pWcState state, pWcOptions options, unsigned char *buff, size_t size, size_t workers);
+// Counts input starting with prefix already read from fd, st is stat of fd or NULL if not known
+static int wc_count_input(int fd, const struct stat *st, const unsigned char *prefix, size_t prefix_size, pWcState state,
+                          pWcOptions options, unsigned char *buff, size_t size, size_t workers);
+// DecompressSink feeding counting engine, context is WcFeed
+static void wc_feed_sink(void *context, const unsigned char *buff, size_t size);
+#if __linux__
+// Counts every regular file under queued directories with options->workers threads
+static void wc_walk_run(pWcWalk walk, pWcOptions options);
+static void wc_walk_add_root(pWcWalk walk, char *path);
+static void *wc_walk_worker(void *arg);
+// Reads directory with getdents64, files are counted at once and subdirectories are queued
+static void wc_walk_scan(pWcWalker worker, pWcDir dir);
+static void wc_walk_file(pWcWalker worker, int dir_fd, char *name, char *path, pWcCounters sum);
+// Prints counted file and adds it to sum, status is result of wc_count_fd
+static void wc_walk_report(pWcWalker worker, char *path, pWcState state, int status, pWcCounters sum);
+static pWcDir wc_walk_new_dir(pWcWalk walk, pWcDir parent, char *path, int parent_fd, char *name);
+static void wc_walk_push(pWcWalk walk, pWcDir *dirs, size_t count);
+static void wc_walk_release(pWcWalker worker, pWcDir dir);
+// Only bytes are requested and taken from stat, files are not opened
+static unsigned char wc_walk_stat_only(pWcOptions options);
+#if WC_HAVE_IO_URING
+// Sets up ring if kernel supports io_uring with openat, read and close, returns -1 otherwise
+static int wc_ring_init(pWcRing ring);
+static void wc_ring_free(pWcRing ring);
+static struct io_uring_sqe *wc_ring_sqe(pWcRing ring, unsigned char opcode, int fd, unsigned long long user_data);
+// Submits queued requests and waits until every submitted request is completed, results go to worker files
+static void wc_ring_wait(pWcWalker worker);
+// Opens and reads first block of batched files of dir, counts them and queues their close
+static void wc_ring_flush(pWcWalker worker, int dir_fd, pWcDir dir, pWcCounters sum);
+#endif
+static void wc_add_counters_atomic(pWcCounters total, pWcCounters counters);
+// Returns length of joined path or 0 if it does not fit PATH_MAX
+static size_t wc_join_path(char *buff, const char *dir, const char *name);
+#endif // __linux__
 
 //#define WC_HEADER_IMPLEMENTATION
 #ifdef WC_HEADER_IMPLEMENTATION
 
 int wc_main(int argc, char **argv)
 {
-    Arglist arg_list = {.footer_msg = "Print newline, word, and byte counts for each FILE, and a total line if "
+    Arglist arg_list = {.footer_msg = "Print newline, word, character and byte counts for each FILE, and a total line if "
                                       "more than one FILE is specified.\nA word is a nonempty sequence of non white"
                                       "space delimited by white space characters or by start or end of input.\n"
+                                      "Characters are counted as UTF-8, invalid sequences are reported and not counted as characters.\n"
+                                      "Compressed input is detected by magic bytes and counted decompressed.\n"
                                       "Usage: wc [OPTION(s)] [FILE]\nWith no FILE, or when FILE is -, read standard input."};
 
     push_argument(&arg_list, (Argument){.key = "-h", .flag = IS_FLAG, .help_msg = "Prints this help message."});
     push_argument(&arg_list, (Argument){.key = "-l", .flag = IS_FLAG, .help_msg = "Include lines number to output."});
     push_argument(&arg_list, (Argument){.key = "-w", .flag = IS_FLAG, .help_msg = "Include words number to output."});
+    push_argument(&arg_list, (Argument){.key = "-m", .flag = IS_FLAG, .help_msg = "Include UTF-8 characters number to output."});
     push_argument(&arg_list, (Argument){.key = "-b", .flag = IS_FLAG, .help_msg = "Include bytes number to output."});
+    push_argument(&arg_list, (Argument){.key = "-L", .flag = IS_FLAG, .help_msg = "Include maximum line length in bytes to output."});
+    push_argument(&arg_list, (Argument){.key = "-H", .flag = IS_FLAG, .help_msg = "Print histogram of line lengths in bytes, in power of two buckets."});
+    push_argument(&arg_list, (Argument){.key = "-u", .flag = IS_FLAG, .help_msg = "Split words on Unicode white space too, input is decoded as UTF-8."});
+    push_argument(&arg_list, (Argument){.key = "-r", .flag = IS_FLAG, .help_msg = "Count files in directories recursively, totals are printed for every directory with trailing '/'."});
+    push_argument(&arg_list, (Argument){.key = "-j", .flag = ARG_OPTIONAL, .help_msg = "Number of threads for -r and for decompression. By default number of online CPUs."});
+    push_argument(&arg_list, (Argument){.key = "-Z", .flag = IS_FLAG, .help_msg = "Do not decompress gzip, BGZF and zstd input, count compressed bytes."});
     push_argument(&arg_list, (Argument){.key = "-d", .flag = DEFAULT_VALUE, .help_msg = "Delimiter for output.", .value = "\t\t"});
+    push_argument(&arg_list, (Argument){.key = "-F", .flag = DEFAULT_VALUE, .help_msg = "Output format: plain, tsv or json.", .value = "plain"});
     push_argument(&arg_list, (Argument){.key = "-", .flag = IS_FLAG, .help_msg = "Use to read from stdin on some point."});
     parse_arguments(argc, argv, &arg_list);
 
@@ -42,106 +289,980 @@ int wc_main(int argc, char **argv)
     return 0;
 }
 
-static void wc_on_file(char *f, size_t *total_lines, size_t *total_words, size_t *total_bytes, pArglist arg_list)
+static int wc_is_unicode_space(unsigned int cp)
+{
+    if (cp < 0x80)
+        return isspace(cp);
+    switch (cp)
+    {
+    case 0x0085:
+    case 0x1680:
+    case 0x2028:
+    case 0x2029:
+    case 0x205F:
+    case 0x3000:
+        return 1;
+    }
+    return (cp >= 0x2000 && cp <= 0x200A && cp != 0x2007);
+}
+
+static size_t wc_count_newlines(const unsigned char *buff, size_t size)
 {
-    size_t file_lines, file_words, file_bytes;
-    size_t line_words, line_bytes;
-    unsigned char *tmp, in_word;
+    size_t lines = 0, i = 0;
+#ifdef __SSE2__
+    const __m128i newline = _mm_set1_epi8('\n');
 
-    file_lines = file_words = file_bytes = 0;
-    file_lines = file_words = file_bytes = 0;
-    line_words = line_bytes = 0;
+    for (; i + 16 <= size; i += 16)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(buff + i));
+        lines += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline)));
+    }
+#endif // __SSE2__
+    for (; i < size; ++i)
+        lines += buff[i] == '\n';
+    return lines;
+}
+
+static inline __attribute__((always_inline)) void wc_kernel(pWcState state, const unsigned char *buff, size_t size, const unsigned int features)
+{
+    pWcCounters counters = &state->counters;
+    const unsigned char *line, *newline, *end;
+    size_t line_begin = 0;
+    unsigned char c;
+    int space;
 
-    uCharArray line = {0};
-    FILE *hFile = (strcmp(f, "-") == 0) ? stdin : fopen(f, "r");
-    if (!hFile)
+    if (!(features & (WC_KERNEL_LENGTHS | WC_KERNEL_WORDS)))
     {
-        fprintf(stderr, "Error: cannot open and skipping file '%s'", f);
+        if (features & WC_KERNEL_LINES)
+            counters->lines += wc_count_newlines(buff, size);
         return;
     }
-    while (read_line(&line, &line_bytes, hFile) != EOF)
+
+    if (!(features & WC_KERNEL_WORDS))
     {
-        file_lines++;
-        file_bytes += line_bytes + 1; // +1 as read_line drops \n
+        // Only newline positions are needed
+        line = buff;
+        end = buff + size;
+        while ((newline = memchr(line, '\n', end - line)) != NULL)
+        {
+            counters->lines++;
+            wc_count_line_length(counters, state->line_length + (newline - line));
+            state->line_length = 0;
+            line = newline + 1;
+        }
+        state->line_length += end - line;
+        return;
+    }
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        c = buff[i];
+        if (c == '\n')
+        {
+            counters->lines++;
+            if (features & WC_KERNEL_LENGTHS)
+            {
+                wc_count_line_length(counters, state->line_length + i - line_begin);
+                state->line_length = 0;
+                line_begin = i + 1;
+            }
+        }
 
-        tmp = line.array;
-        in_word = 0;
-        while (*tmp != '\0')
+        if (!(features & WC_KERNEL_UNICODE) || c < 0x80)
         {
-            if (isspace(*tmp))
+            if ((features & WC_KERNEL_UNICODE) && state->cp_need)
             {
-                in_word = 0;
-                while (isspace(*tmp))
-                    tmp++;
+                wc_count_word_char(state); // Interrupted sequence
+                state->cp_need = 0;
             }
-            if (*tmp != '\0' && in_word == 0)
+            space = isspace(c);
+        }
+        else
+        {
+            if (state->cp_need)
             {
-                in_word = 1;
-                line_words++;
+                if (c >= state->cp_lower && c <= state->cp_upper)
+                {
+                    state->cp = (state->cp << 6) | (c & 0x3F);
+                    state->cp_lower = 0x80;
+                    state->cp_upper = 0xBF;
+                    if (--state->cp_need)
+                        continue;
+                    if (wc_is_unicode_space(state->cp))
+                        state->in_word = 0;
+                    else
+                        wc_count_word_char(state);
+                    continue;
+                }
+                wc_count_word_char(state); // Interrupted sequence, byte starts a new one
             }
-            tmp++;
+            state->cp_need = utf8_sequence_length(c);
+            if (state->cp_need)
+            {
+                state->cp = c & (0x7F >> state->cp_need);
+                state->cp_need--;
+                utf8_second_byte_bounds(c, &state->cp_lower, &state->cp_upper);
+                continue;
+            }
+            space = 0; // Byte that cannot start a sequence
+        }
+
+        if (space)
+            state->in_word = 0;
+        else
+            wc_count_word_char(state);
+    }
+    if (features & WC_KERNEL_LENGTHS)
+        state->line_length += size - line_begin;
+}
+
+#define WC_DEFINE_KERNEL(features)                                                             \
+    static void wc_kernel_##features(pWcState state, const unsigned char *buff, size_t size) \
+    {                                                                                          \
+        wc_kernel(state, buff, size, features);                                                \
+    }
+
+WC_DEFINE_KERNEL(0)
+WC_DEFINE_KERNEL(1)
+WC_DEFINE_KERNEL(2)
+WC_DEFINE_KERNEL(3)
+WC_DEFINE_KERNEL(4)
+WC_DEFINE_KERNEL(5)
+WC_DEFINE_KERNEL(6)
+WC_DEFINE_KERNEL(7)
+WC_DEFINE_KERNEL(8)
+WC_DEFINE_KERNEL(9)
+WC_DEFINE_KERNEL(10)
+WC_DEFINE_KERNEL(11)
+WC_DEFINE_KERNEL(12)
+WC_DEFINE_KERNEL(13)
+WC_DEFINE_KERNEL(14)
+WC_DEFINE_KERNEL(15)
+
+// Indexed by WC_KERNEL_* combination
+static const WcKernel wc_kernels[WC_KERNELS] = {
+    wc_kernel_0, wc_kernel_1, wc_kernel_2, wc_kernel_3,
+    wc_kernel_4, wc_kernel_5, wc_kernel_6, wc_kernel_7,
+    wc_kernel_8, wc_kernel_9, wc_kernel_10, wc_kernel_11,
+    wc_kernel_12, wc_kernel_13, wc_kernel_14, wc_kernel_15};
+
+static void wc_resolve_options(pArglist arg_list, pWcOptions options, pOutput output)
+{
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int features = 0;
+    int format;
+
+    options->counters = 0;
+    if (is_flag_set(arg_list, "-l"))
+        options->counters |= WC_LINES;
+    if (is_flag_set(arg_list, "-w"))
+        options->counters |= WC_WORDS;
+    if (is_flag_set(arg_list, "-m"))
+        options->counters |= WC_CHARS;
+    if (is_flag_set(arg_list, "-b"))
+        options->counters |= WC_BYTES;
+    if (is_flag_set(arg_list, "-L"))
+        options->counters |= WC_MAX_LINE_LENGTH;
+    if (!options->counters)
+        options->counters = WC_LINES | WC_WORDS | WC_BYTES;
+    if (is_flag_set(arg_list, "-H"))
+        options->counters |= WC_HISTOGRAM;
+    if (is_flag_set(arg_list, "-u"))
+        options->counters |= WC_UNICODE_WORDS;
+    if (is_flag_set(arg_list, "-Z"))
+        options->counters |= WC_RAW;
+
+    if (options->counters & WC_LINES)
+        features |= WC_KERNEL_LINES;
+    if (options->counters & (WC_MAX_LINE_LENGTH | WC_HISTOGRAM))
+        features |= WC_KERNEL_LENGTHS;
+    if (options->counters & WC_WORDS)
+        features |= WC_KERNEL_WORDS;
+    if ((options->counters & WC_WORDS) && (options->counters & WC_UNICODE_WORDS))
+        features |= WC_KERNEL_UNICODE;
+    options->kernel = wc_kernels[features];
+
+    if (is_value_set(arg_list, "-j") && (workers = atol(get_value_by_key(arg_list, "-j"))) <= 0)
+        report_error_and_exit("wrong value specified for -j '%s'\n", get_value_by_key(arg_list, "-j"));
+    options->workers = workers > 0 ? workers : 1;
+
+    if ((format = output_parse_format(get_value_by_key(arg_list, "-F"))) == -1)
+        report_error_and_exit("wrong value specified for -F '%s'\n", get_value_by_key(arg_list, "-F"));
+    output_init(output, STDOUT_FILENO, format, get_value_by_key(arg_list, "-d"), 1000);
+    options->output = output;
+}
+
+static void wc_feed(pWcState state, pWcOptions options, const unsigned char *buff, size_t size)
+{
+    state->counters.bytes += size;
+    options->kernel(state, buff, size);
+    if (options->counters & (WC_CHARS | WC_UNICODE_WORDS))
+        utf8_count(&state->utf8, buff, size);
+}
+
+static void wc_finish(pWcState state, pWcOptions options)
+{
+    if (state->cp_need)
+        wc_count_word_char(state); // Input ends with incomplete sequence
+    if (state->line_length)
+        wc_count_line_length(&state->counters, state->line_length); // Last line without newline
+    if (options->counters & (WC_CHARS | WC_UNICODE_WORDS))
+    {
+        utf8_count_finish(&state->utf8);
+        state->counters.chars = state->utf8.chars;
+        state->counters.invalid = state->utf8.invalid;
+    }
+}
+
+static inline void wc_count_line_length(pWcCounters counters, size_t length)
+{
+    if (length > counters->max_line_length)
+        counters->max_line_length = length;
+    // long is 32 bits on Windows, long long is 64 bits everywhere
+    counters->line_lengths[length ? sizeof(unsigned long long) * 8 - __builtin_clzll(length) : 0]++;
+}
+
+static inline void wc_count_word_char(pWcState state)
+{
+    if (!state->in_word)
+    {
+        state->in_word = 1;
+        state->counters.words++;
+    }
+}
+
+static void wc_on_file(char *f, pWcCounters total, pWcOptions options)
+{
+    static unsigned char buff[WC_BUFFER_SIZE];
+    WcState state = {0};
+    int fd, status;
+
+    fd = (strcmp(f, "-") == 0) ? STDIN_FILENO : open(f, O_RDONLY);
+    if (fd == -1)
+    {
+        fprintf(stderr, "Error: cannot open and skipping file '%s'\n", f);
+        return;
+    }
+
+    if ((status = wc_count_fd(fd, &state, options, buff, sizeof(buff), options->workers)) == DECOMPRESS_ERROR_READ)
+        warning("failed to read file '%s', counts are incomplete\n", f);
+    else if (status == DECOMPRESS_ERROR_DATA)
+        warning("compressed file '%s' is corrupted or truncated, counts are incomplete\n", f);
+    else if (status == DECOMPRESS_ERROR_UNSUPPORTED)
+        warning("'%s' is zstd compressed, but zstd support is not built in, it is not counted (use -Z to count it as is)\n", f);
+    wc_finish(&state, options);
+    if (state.counters.invalid)
+        warning("'%s' contains %zu invalid UTF-8 sequence(s), they are not counted as characters\n", f, state.counters.invalid);
+
+    wc_add_counters(total, &state.counters);
+    wc_print_counters(&state.counters, f, options);
+    if (options->counters & WC_HISTOGRAM)
+        wc_print_histogram(&state.counters, f, options);
+
+    if (fd != STDIN_FILENO)
+        close(fd);
+}
+
+static int wc_read_fd(int fd, pWcState state, pWcOptions options, unsigned char *buff, size_t size, off_t remaining)
+{
+    ssize_t bytes_read;
+    off_t total = 0;
+
+    while ((bytes_read = read(fd, buff, size)) != 0)
+    {
+        if (bytes_read == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
         }
-        file_words += line_words;
-        line_words = line_bytes = 0;
+        wc_feed(state, options, buff, bytes_read);
+        // Reached only when reading from start of file, otherwise read returns 0 at the end
+        if ((total += bytes_read) == remaining)
+            break;
     }
-    free_array(line);
-    *total_lines += file_lines;
-    *total_bytes += file_bytes;
-    *total_words += file_words;
+    return 0;
+}
 
-    if (!is_flag_set(arg_list, "-l") && !is_flag_set(arg_list, "-w") && !is_flag_set(arg_list, "-b"))
-        printf("%-zu%s%-zu%s%-zu%s%s\n", file_lines, get_value_by_key(arg_list, "-d"),
-               file_words, get_value_by_key(arg_list, "-d"), file_bytes, get_value_by_key(arg_list, "-d"), f);
+static void wc_feed_sink(void *context, const unsigned char *buff, size_t size)
+{
+    pWcFeed feed = context;
+    wc_feed(feed->state, feed->options, buff, size);
+}
+
+static int wc_count_fd(int fd, pWcState state, pWcOptions options, unsigned char *buff, size_t size, size_t workers)
+{
+    size_t prefix_size = 0;
+    struct stat st;
+    int stat_status = fstat(fd, &st);
+
+    if (!(options->counters & WC_RAW))
+        decompress_detect_fd(fd, buff, size, &prefix_size);
+    return wc_count_input(fd, stat_status == 0 ? &st : NULL, buff, prefix_size, state, options, buff, size, workers);
+}
+
+static int wc_count_input(int fd, const struct stat *st, const unsigned char *prefix, size_t prefix_size, pWcState state,
+                          pWcOptions options, unsigned char *buff, size_t size, size_t workers)
+{
+    WcFeed feed = {.state = state, .options = options};
+    unsigned char regular = st && S_ISREG(st->st_mode);
+    off_t offset;
+    int format;
+
+    if (!(options->counters & WC_RAW) && (format = decompress_detect(prefix, prefix_size)) != DECOMPRESS_NONE)
+        return decompress_fd(fd, st, prefix, prefix_size, format, workers, wc_feed_sink, &feed);
+
+    if (regular && options->kernel == wc_kernels[0] && !(options->counters & (WC_CHARS | WC_UNICODE_WORDS)) &&
+        st->st_size > 0 && (offset = lseek(fd, 0, SEEK_CUR)) != -1)
+    {
+        // Size of regular file is known without reading the rest of it
+        state->counters.bytes = prefix_size + (offset < st->st_size ? st->st_size - offset : 0);
+        lseek(fd, 0, SEEK_END);
+        return 0;
+    }
+    // Block read while detecting format is the start of input
+    if (prefix_size)
+        wc_feed(state, options, prefix, prefix_size);
+    if (regular && st->st_size > 0 && (off_t)prefix_size >= st->st_size)
+        return 0;
+    return wc_read_fd(fd, state, options, buff, size, regular ? st->st_size - prefix_size : 0) == -1 ? DECOMPRESS_ERROR_READ : 0;
+}
+
+#if __linux__
+
+static void wc_add_counters_atomic(pWcCounters total, pWcCounters counters)
+{
+    size_t max_line_length = __atomic_load_n(&total->max_line_length, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&total->lines, counters->lines, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&total->words, counters->words, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&total->bytes, counters->bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&total->chars, counters->chars, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&total->invalid, counters->invalid, __ATOMIC_RELAXED);
+    while (counters->max_line_length > max_line_length &&
+           !__atomic_compare_exchange_n(&total->max_line_length, &max_line_length, counters->max_line_length, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    for (size_t i = 0; i < WC_HISTOGRAM_BUCKETS; ++i)
+        if (counters->line_lengths[i])
+            __atomic_fetch_add(&total->line_lengths[i], counters->line_lengths[i], __ATOMIC_RELAXED);
+}
+
+static size_t wc_join_path(char *buff, const char *dir, const char *name)
+{
+    size_t dir_length = strlen(dir), name_length = strlen(name);
+
+    if (dir_length + name_length + 2 > PATH_MAX)
+        return 0;
+    memcpy(buff, dir, dir_length);
+    if (dir_length && dir[dir_length - 1] != '/')
+        buff[dir_length++] = '/';
+    memcpy(buff + dir_length, name, name_length + 1);
+    return dir_length + name_length;
+}
+
+static void wc_walk_push(pWcWalk walk, pWcDir *dirs, size_t count)
+{
+    if (!count)
+        return;
+    pthread_mutex_lock(&walk->lock);
+    for (size_t i = 0; i < count; ++i)
+    {
+        append(pWcDir, walk->queue, dirs[i]);
+    }
+    pthread_cond_broadcast(&walk->cond);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+static pWcDir wc_walk_new_dir(pWcWalk walk, pWcDir parent, char *path, int parent_fd, char *name)
+{
+    pWcDir dir = calloc(1, sizeof(WcDir));
+    if (!dir || !(dir->path = strdup(path)))
+        report_error_and_exit("cannot allocate memory for directory '%s'\n", path);
+    dir->parent = parent;
+    dir->pending = 1; // Scan of the directory itself
+    dir->fd = -1;
+    // Keep descriptor opened relative to parent while limit allows, otherwise path is resolved on scan
+    if (parent_fd != -1)
+    {
+        if (__atomic_add_fetch(&walk->open_dirs, 1, __ATOMIC_RELAXED) <= WC_WALK_MAX_OPEN_DIRS)
+            dir->fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (dir->fd == -1)
+            __atomic_sub_fetch(&walk->open_dirs, 1, __ATOMIC_RELAXED);
+    }
+    if (parent)
+        __atomic_add_fetch(&parent->pending, 1, __ATOMIC_RELAXED);
+    return dir;
+}
+
+// Drops one pending unit of directory, finished directory is printed and passed to its parent
+static void wc_walk_release(pWcWalker worker, pWcDir dir)
+{
+    char name[PATH_MAX + 2];
+    pWcDir parent;
+    size_t length;
+
+    while (dir && __atomic_sub_fetch(&dir->pending, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        parent = dir->parent;
+        // Trailing slash marks total of the whole subtree
+        length = strlen(dir->path);
+        memcpy(name, dir->path, length);
+        name[length] = length && dir->path[length - 1] == '/' ? '\0' : '/';
+        name[length + 1] = '\0';
+        wc_print_counters(&dir->subtree, name, &worker->options);
+        if (worker->options.counters & WC_HISTOGRAM)
+            wc_print_histogram(&dir->subtree, name, &worker->options);
+        wc_add_counters_atomic(parent ? &parent->subtree : &worker->walk->total, &dir->subtree);
+        free(dir->path);
+        free(dir);
+        dir = parent;
+    }
+}
+
+static void wc_walk_report(pWcWalker worker, char *path, pWcState state, int status, pWcCounters sum)
+{
+    pWcOptions options = &worker->options;
+
+    if (status == DECOMPRESS_ERROR_READ)
+        warning("failed to read file '%s', counts are incomplete\n", path);
+    else if (status == DECOMPRESS_ERROR_DATA)
+        warning("compressed file '%s' is corrupted or truncated, counts are incomplete\n", path);
+    else if (status == DECOMPRESS_ERROR_UNSUPPORTED)
+        warning("'%s' is zstd compressed, but zstd support is not built in, it is not counted (use -Z to count it as is)\n", path);
+    wc_finish(state, options);
+    if (state->counters.invalid)
+        warning("'%s' contains %zu invalid UTF-8 sequence(s), they are not counted as characters\n", path, state->counters.invalid);
+    wc_add_counters(sum, &state->counters);
+    wc_print_counters(&state->counters, path, options);
+}
+
+static unsigned char wc_walk_stat_only(pWcOptions options)
+{
+    return options->kernel == wc_kernels[0] && !(options->counters & (WC_CHARS | WC_UNICODE_WORDS)) && (options->counters & WC_RAW);
+}
+
+static void wc_walk_file(pWcWalker worker, int dir_fd, char *name, char *path, pWcCounters sum)
+{
+    pWcOptions options = &worker->options;
+    WcState state = {0};
+    struct stat st;
+    int fd, status = 0;
+
+    if (wc_walk_stat_only(options))
+    {
+        if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+        {
+            warning("cannot stat file '%s'\n", path);
+            return;
+        }
+        state.counters.bytes = st.st_size;
+    }
+    else
+    {
+        fd = openat(dir_fd, name, O_RDONLY | O_NOCTTY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd == -1)
+        {
+            warning("cannot open file '%s'\n", path);
+            return;
+        }
+        // Files are already counted in parallel, decompression takes no more threads
+        status = wc_count_fd(fd, &state, options, worker->buff, sizeof(worker->buff), 1);
+        close(fd);
+    }
+    wc_walk_report(worker, path, &state, status, sum);
+}
+
+#if WC_HAVE_IO_URING
+
+static int wc_ring_init(pWcRing ring)
+{
+    static const unsigned char opcodes[] = {IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_CLOSE};
+    struct io_uring_params params = {0};
+    struct io_uring_probe *probe;
+    unsigned char *sq, *cq;
+    unsigned char supported;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->sq_map = ring->cq_map = ring->sqes = MAP_FAILED;
+    // Closes of previous batch are submitted with opens of next one. Completion work is run only when
+    // worker waits for it, kernels before 6.1 take no flags
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    if ((ring->fd = syscall(SYS_io_uring_setup, 2 * WC_RING_BATCH, &params)) == -1 && errno == EINVAL)
+    {
+        memset(&params, 0, sizeof(params));
+        ring->fd = syscall(SYS_io_uring_setup, 2 * WC_RING_BATCH, &params);
+    }
+    if (ring->fd == -1)
+        return -1;
+
+    // Reads with offset -1 advance file position, so the rest of file is read from where ring stopped
+    probe = calloc(1, sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op));
+    supported = probe && (params.features & IORING_FEAT_RW_CUR_POS) &&
+                syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0;
+    for (size_t i = 0; supported && i < sizeof(opcodes); ++i)
+        supported = opcodes[i] <= probe->last_op && (probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    if (!supported)
+    {
+        wc_ring_free(ring);
+        return -1;
+    }
+
+    ring->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->sq_map_size = ring->cq_map_size = ring->sq_map_size > ring->cq_map_size ? ring->sq_map_size : ring->cq_map_size;
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq_map = ring->sq_map;
     else
+        ring->cq_map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqes == MAP_FAILED)
     {
-        if (is_flag_set(arg_list, "-l"))
-            printf("%-zu%s", file_lines, get_value_by_key(arg_list, "-d"));
-        if (is_flag_set(arg_list, "-w"))
-            printf("%-zu%s", file_words, get_value_by_key(arg_list, "-d"));
-        if (is_flag_set(arg_list, "-b"))
-            printf("%-zu%s", file_bytes, get_value_by_key(arg_list, "-d"));
-        printf("%s\n", f);
+        wc_ring_free(ring);
+        return -1;
     }
 
-    file_lines = file_words = file_bytes = 0;
-    if (strcmp(f, "-"))
-        fclose(hFile);
+    sq = ring->sq_map;
+    cq = ring->cq_map;
+    ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+static void wc_ring_free(pWcRing ring)
+{
+    if (ring->fd == -1)
+        return;
+    if (ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map)
+        munmap(ring->cq_map, ring->cq_map_size);
+    if (ring->sq_map != MAP_FAILED)
+        munmap(ring->sq_map, ring->sq_map_size);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+static struct io_uring_sqe *wc_ring_sqe(pWcRing ring, unsigned char opcode, int fd, unsigned long long user_data)
+{
+    // Only this worker writes tail, kernel reads it after release
+    unsigned int tail = *ring->sq_tail, index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+    return sqe;
+}
+
+static void wc_ring_wait(pWcWalker worker)
+{
+    pWcRing ring = &worker->ring;
+    struct io_uring_cqe *cqe;
+    pWcRingFile file;
+    unsigned int head, tail;
+    long submitted;
+
+    ring->inflight += ring->queued;
+    while (ring->inflight)
+    {
+        submitted = syscall(SYS_io_uring_enter, ring->fd, ring->queued, ring->inflight, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (submitted == -1)
+        {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            report_error_and_exit("cannot submit io_uring requests\n");
+        }
+        ring->queued -= submitted;
+
+        head = *ring->cq_head;
+        tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head, --ring->inflight)
+        {
+            cqe = &ring->cqes[head & *ring->cq_mask];
+            file = &worker->files[cqe->user_data >> 2];
+            switch (cqe->user_data & 3)
+            {
+            case WC_RING_OPEN:
+                file->fd = cqe->res;
+                break;
+            case WC_RING_READ:
+                file->bytes_read = cqe->res;
+                break;
+            case WC_RING_READ_END:
+                file->end_read = cqe->res;
+                break;
+            }
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+static void wc_ring_flush(pWcWalker worker, int dir_fd, pWcDir dir, pWcCounters sum)
+{
+    pWcRing ring = &worker->ring;
+    struct io_uring_sqe *sqe;
+    pWcRingFile file;
+    WcState state;
+    struct stat st;
+    size_t prefix_size;
+    int status;
+
+    for (size_t i = 0; i < worker->files_count; ++i)
+    {
+        sqe = wc_ring_sqe(ring, IORING_OP_OPENAT, dir_fd, i << 2 | WC_RING_OPEN);
+        sqe->addr = (unsigned long)worker->files[i].name;
+        sqe->open_flags = O_RDONLY | O_NOCTTY | O_NOFOLLOW | O_CLOEXEC;
+    }
+    wc_ring_wait(worker);
+
+    for (size_t i = 0; i < worker->files_count; ++i)
+    {
+        file = &worker->files[i];
+        if (file->fd < 0)
+            continue;
+        sqe = wc_ring_sqe(ring, IORING_OP_READ, file->fd, i << 2 | WC_RING_READ);
+        sqe->addr = (unsigned long)worker->ring_buffs[i];
+        sqe->len = WC_RING_READ_SIZE;
+        sqe->off = -1;
+    }
+    wc_ring_wait(worker);
+
+    // Short read is not the end of file, it is found by read returning 0
+    for (size_t i = 0; i < worker->files_count; ++i)
+    {
+        file = &worker->files[i];
+        if (file->fd < 0 || !WC_RING_READS_END(file))
+            continue;
+        sqe = wc_ring_sqe(ring, IORING_OP_READ, file->fd, i << 2 | WC_RING_READ_END);
+        sqe->addr = (unsigned long)(worker->ring_buffs[i] + file->bytes_read);
+        sqe->len = WC_RING_READ_SIZE - file->bytes_read;
+        sqe->off = -1;
+    }
+    wc_ring_wait(worker);
+
+    for (size_t i = 0; i < worker->files_count; ++i)
+    {
+        file = &worker->files[i];
+        // Path length was checked when file was batched
+        wc_join_path(worker->path, dir->path, file->name);
+        if (file->fd < 0)
+        {
+            warning("cannot open file '%s'\n", worker->path);
+            continue;
+        }
+        memset(&state, 0, sizeof(state));
+        status = 0;
+        prefix_size = file->bytes_read + (WC_RING_READS_END(file) && file->end_read > 0 ? file->end_read : 0);
+        if (file->bytes_read < 0 || (WC_RING_READS_END(file) && file->end_read < 0))
+            status = DECOMPRESS_ERROR_READ;
+        else if (file->bytes_read == 0 || (WC_RING_READS_END(file) && file->end_read == 0))
+        {
+            // Whole file is read, its size is known
+            memset(&st, 0, sizeof(st));
+            st.st_mode = S_IFREG;
+            st.st_size = prefix_size;
+            if (prefix_size)
+                status = wc_count_input(file->fd, &st, worker->ring_buffs[i], prefix_size, &state, &worker->options,
+                                        worker->buff, sizeof(worker->buff), 1);
+        }
+        else
+            status = wc_count_input(file->fd, fstat(file->fd, &st) == 0 ? &st : NULL, worker->ring_buffs[i], prefix_size,
+                                    &state, &worker->options, worker->buff, sizeof(worker->buff), 1);
+        wc_walk_report(worker, worker->path, &state, status, sum);
+        wc_ring_sqe(ring, IORING_OP_CLOSE, file->fd, i << 2 | WC_RING_CLOSE);
+    }
+    worker->files_count = 0;
+}
+
+#endif // WC_HAVE_IO_URING
+
+static void wc_walk_scan(pWcWalker worker, pWcDir dir)
+{
+    pWcDir children[WC_WALK_PUSH_BATCH];
+    size_t children_count = 0;
+    WcCounters sum = {0};
+    struct dirent64 *entry;
+    struct stat st;
+    unsigned char type;
+    long bytes_read;
+    int fd;
+
+    fd = dir->fd;
+    if (fd == -1)
+        fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        warning("cannot open directory '%s'\n", dir->path);
+        wc_walk_release(worker, dir);
+        return;
+    }
+
+    while ((bytes_read = syscall(SYS_getdents64, fd, worker->dents, sizeof(worker->dents))) > 0)
+    {
+        for (long offset = 0; offset < bytes_read; offset += entry->d_reclen)
+        {
+            entry = (struct dirent64 *)(worker->dents + offset);
+            if (entry->d_name[0] == '.' && (entry->d_name[1] == '\0' || (entry->d_name[1] == '.' && entry->d_name[2] == '\0')))
+                continue;
+            if (!wc_join_path(worker->path, dir->path, entry->d_name))
+            {
+                warning("path is too long, skipping '%s/%s'\n", dir->path, entry->d_name);
+                continue;
+            }
+
+            type = entry->d_type;
+            if (type == DT_UNKNOWN)
+            {
+                if (fstatat(fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+                    continue;
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+
+            // Symbolic links and special files are skipped
+#if WC_HAVE_IO_URING
+            if (type == DT_REG && worker->ring.fd != -1)
+            {
+                worker->files[worker->files_count++].name = entry->d_name;
+                if (worker->files_count == WC_RING_BATCH)
+                    wc_ring_flush(worker, fd, dir, &sum);
+            }
+            else
+#endif
+            if (type == DT_REG)
+                wc_walk_file(worker, fd, entry->d_name, worker->path, &sum);
+            else if (type == DT_DIR)
+            {
+                children[children_count++] = wc_walk_new_dir(worker->walk, dir, worker->path, fd, entry->d_name);
+                if (children_count == WC_WALK_PUSH_BATCH)
+                {
+                    wc_walk_push(worker->walk, children, children_count);
+                    children_count = 0;
+                }
+            }
+        }
+#if WC_HAVE_IO_URING
+        if (worker->files_count)
+            wc_ring_flush(worker, fd, dir, &sum);
+#endif
+    }
+    if (bytes_read == -1)
+        warning("cannot read directory '%s'\n", dir->path);
+    close(fd);
+    if (dir->fd != -1)
+        __atomic_sub_fetch(&worker->walk->open_dirs, 1, __ATOMIC_RELAXED);
+    wc_walk_push(worker->walk, children, children_count);
+
+    wc_add_counters_atomic(&dir->subtree, &sum);
+    wc_walk_release(worker, dir);
+}
+
+static void *wc_walk_worker(void *arg)
+{
+    pWcWalker worker = arg;
+    pWcWalk walk = worker->walk;
+    pWcDir dir;
+
+#if WC_HAVE_IO_URING
+    // Ring is set up by the thread using it, walk falls back to plain system calls where io_uring is not available
+    worker->ring.fd = -1;
+    if (!wc_walk_stat_only(&worker->options))
+        wc_ring_init(&worker->ring);
+#endif
+    pthread_mutex_lock(&walk->lock);
+    while (1)
+    {
+        while (!walk->queue.count && walk->active)
+            pthread_cond_wait(&walk->cond, &walk->lock);
+        if (!walk->queue.count)
+            break; // Nothing queued and nobody scanning, walk is finished
+        dir = walk->queue.array[--walk->queue.count];
+        walk->active++;
+        pthread_mutex_unlock(&walk->lock);
+
+        wc_walk_scan(worker, dir);
+
+        pthread_mutex_lock(&walk->lock);
+        walk->active--;
+        if (!walk->active && !walk->queue.count)
+            pthread_cond_broadcast(&walk->cond);
+    }
+    pthread_mutex_unlock(&walk->lock);
+#if WC_HAVE_IO_URING
+    // Closes of last batch
+    if (worker->ring.fd != -1 && worker->ring.queued)
+        wc_ring_wait(worker);
+    wc_ring_free(&worker->ring);
+#endif
+    output_flush(&worker->output);
+    return NULL;
+}
+
+static void wc_walk_add_root(pWcWalk walk, char *path)
+{
+    pWcDir root = wc_walk_new_dir(walk, NULL, path, -1, NULL);
+    size_t length = strlen(root->path);
+
+    while (length > 1 && root->path[length - 1] == '/')
+        root->path[--length] = '\0';
+    append(pWcDir, walk->queue, root);
+}
+
+static void wc_walk_run(pWcWalk walk, pWcOptions options)
+{
+    static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+    size_t workers_count = options->workers;
+    pWcWalker workers = calloc(workers_count, sizeof(WcWalker));
+    pthread_t *threads = calloc(workers_count, sizeof(pthread_t));
+
+    if (!workers || !threads)
+        report_error_and_exit("cannot allocate memory for workers\n");
+
+    output_flush(options->output);
+    for (size_t i = 0; i < workers_count; ++i)
+    {
+        workers[i].walk = walk;
+        workers[i].options = *options;
+        workers[i].options.output = &workers[i].output;
+        output_init(&workers[i].output, options->output->fd, options->output->format,
+                    options->output->delimiter, options->output->flush_interval_ms);
+        workers[i].output.lock = &output_lock;
+        if (pthread_create(&threads[i], NULL, wc_walk_worker, &workers[i]))
+            report_error_and_exit("cannot create worker thread\n");
+    }
+    for (size_t i = 0; i < workers_count; ++i)
+        pthread_join(threads[i], NULL);
+
+    free(workers);
+    free(threads);
+    free_array(walk->queue);
+}
+
+#endif // __linux__
+
+static void wc_add_counters(pWcCounters total, pWcCounters counters)
+{
+    total->lines += counters->lines;
+    total->words += counters->words;
+    total->bytes += counters->bytes;
+    total->chars += counters->chars;
+    total->invalid += counters->invalid;
+    if (counters->max_line_length > total->max_line_length)
+        total->max_line_length = counters->max_line_length;
+    for (size_t i = 0; i < WC_HISTOGRAM_BUCKETS; ++i)
+        total->line_lengths[i] += counters->line_lengths[i];
+}
+
+static void wc_print_counters(pWcCounters counters, char *name, pWcOptions options)
+{
+    pOutput out = options->output;
+
+    if (options->counters & WC_LINES)
+        output_field_uint(out, "lines", counters->lines);
+    if (options->counters & WC_WORDS)
+        output_field_uint(out, "words", counters->words);
+    if (options->counters & WC_CHARS)
+        output_field_uint(out, "chars", counters->chars);
+    if (options->counters & WC_BYTES)
+        output_field_uint(out, "bytes", counters->bytes);
+    if (options->counters & WC_MAX_LINE_LENGTH)
+        output_field_uint(out, "max_line_length", counters->max_line_length);
+    output_field_str(out, "name", name);
+    output_end_record(out);
+}
+
+static void wc_print_histogram(pWcCounters counters, char *name, pWcOptions options)
+{
+    pOutput out = options->output;
+    size_t low, high;
+
+    if (out->format == OUTPUT_PLAIN)
+    {
+        output_str(out, "Line lengths histogram for ");
+        output_str(out, name);
+        output_str(out, ":");
+        output_end_record(out);
+    }
+    for (size_t i = 0; i < WC_HISTOGRAM_BUCKETS; ++i)
+    {
+        if (!counters->line_lengths[i])
+            continue;
+        low = i ? (size_t)1 << (i - 1) : 0;
+        high = i ? low + (low - 1) : 0;
+        if (out->format == OUTPUT_PLAIN)
+        {
+            output_uint(out, low);
+            output_str(out, "-");
+            output_uint(out, high);
+            output_str(out, out->delimiter);
+            output_uint(out, counters->line_lengths[i]);
+        }
+        else
+        {
+            output_field_str(out, "histogram", name);
+            output_field_uint(out, "low", low);
+            output_field_uint(out, "high", high);
+            output_field_uint(out, "lines", counters->line_lengths[i]);
+        }
+        output_end_record(out);
+    }
 }
 
 static void wc_implementation(pArglist arg_list)
 {
-    size_t total_lines, total_words, total_bytes;
+    static Output output;
+    WcCounters total = {0};
+    WcOptions options = {0};
     size_t current_file, files_read;
     char *f;
+#if __linux__
+    WcWalk walk = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+    unsigned char recursive = is_flag_set(arg_list, "-r") != 0;
+    struct stat st;
+#endif // __linux__
 
-    total_lines = total_words = total_bytes = 0;
     files_read = current_file = 0;
+    wc_resolve_options(arg_list, &options, &output);
 
     while ((f = get_next_positional_value(arg_list, &current_file)) != NULL)
     {
-        wc_on_file(f, &total_lines, &total_words, &total_bytes, arg_list);
+#if __linux__
+        // Directories are walked after plain files, each prints its subtree total
+        if (recursive && strcmp(f, "-") && stat(f, &st) == 0 && S_ISDIR(st.st_mode))
+            wc_walk_add_root(&walk, f);
+        else
+#endif // __linux__
+            wc_on_file(f, &total, &options);
         files_read++;
     }
-    if (!files_read)
+#if __linux__
+    if (walk.queue.count)
     {
-        wc_on_file("-", &total_lines, &total_words, &total_bytes, arg_list);
+        wc_walk_run(&walk, &options);
+        wc_add_counters(&total, &walk.total);
     }
+#endif // __linux__
+    if (!files_read)
+        wc_on_file("-", &total, &options);
     else if (files_read > 1)
     {
-        if (!is_flag_set(arg_list, "-l") && !is_flag_set(arg_list, "-w") && !is_flag_set(arg_list, "-b"))
-            printf("%-zu%s%-zu%s%-zu%s%s\n", total_lines, get_value_by_key(arg_list, "-d"),
-                   total_words, get_value_by_key(arg_list, "-d"), total_bytes, get_value_by_key(arg_list, "-d"), "total");
-        else
-        {
-            if (is_flag_set(arg_list, "-l"))
-                printf("%-zu%s", total_lines, get_value_by_key(arg_list, "-d"));
-            if (is_flag_set(arg_list, "-w"))
-                printf("%-zu%s", total_words, get_value_by_key(arg_list, "-d"));
-            if (is_flag_set(arg_list, "-b"))
-                printf("%-zu%s", total_bytes, get_value_by_key(arg_list, "-d"));
-            printf("%s\n", "total");
-        }
+        wc_print_counters(&total, "total", &options);
+        if (options.counters & WC_HISTOGRAM)
+            wc_print_histogram(&total, "total", &options);
     }
+    output_flush(&output);
 }
 
 #endif // WC_HEADER_IMPLEMENTATION